@@ -1,8 +1,23 @@
 #ifndef CS171_HW4_INCLUDE_ACCEL_H_
 #define CS171_HW4_INCLUDE_ACCEL_H_
 #include <geometry.h>
+#include <algorithm>
 #include <vector>
 #include <memory>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <utility>
+
+/* SIMD box tests are used when the instruction sets are available */
+#if !defined(FLOAT_AS_DOUBLE) && \
+    (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define ACCEL_USE_SSE 1
+#include <immintrin.h>
+#if defined(__AVX__)
+#define ACCEL_USE_AVX 1
+#endif
+#endif
 
 /**
  * Axis-Aligned Bounding Box
@@ -38,28 +53,437 @@ struct AABB {
   bool rayIntersection(const Ray &ray, Float &tIn, Float &tOut) const;
   bool pointIntersection(const vec3 pos);
   Float computeCost(int triangle_num);
+  /* Get the surface area of the AABB */
+  [[nodiscard]] Float surfaceArea() const;
+};
+
+/**
+ * Node of the flattened k-d tree (32 bytes when Float is float)
+ * The first child of an interior node is stored right after it, only the
+ * index of the second child is recorded. A leaf refers to nPrimitives
+ * consecutive entries of the primitive index array, or to the triangle
+ * blocks holding them once the tree is finished.
+ */
+struct LinearKdTreeNode {
+  AABB box;
+  union {
+    int primitivesOffset;   // leaf
+    int secondChildOffset;  // interior
+  };
+  uint16_t nPrimitives;  // 0 for interior nodes
+  uint8_t axis;          // split axis of interior nodes
+  uint8_t pad[1];
 };
+#ifndef FLOAT_AS_DOUBLE
+static_assert(sizeof(LinearKdTreeNode) == 32, "LinearKdTreeNode should be 32 bytes");
+#endif
 
-class KdTreeNode {
+/**
+ * Triangles an accelerator is built over, registered as whole meshes
+ * A triangle is referenced by its mesh and its index in the mesh, primitive
+ * ids number all triangles of all meshes in order. Material and light are
+ * stored once per mesh.
+ */
+class MeshPrimitives {
  public:
-  explicit KdTreeNode(std::vector<std::shared_ptr<Triangle>> triangles, AABB box, int depth);
-  ~KdTreeNode();
-  bool intersect(Interaction &interaction, const Ray &ray) const;
-  [[nodiscard]] bool isLeaf() const { return !leftChild && !rightChild; }
+  struct Ref {
+    int mesh;
+    int triangle;
+  };
+
+  MeshPrimitives() = default;
+  /**
+   * @param[in] meshes the meshes, including those of area lights
+   * @param[in] lightIds index of the light every mesh belongs to, -1 for
+   *            plain geometry, may be empty if there are no light meshes
+   */
+  explicit MeshPrimitives(std::vector<std::shared_ptr<Mesh>> meshes,
+                          std::vector<int> lightIds = {});
+  /* Number of triangles */
+  [[nodiscard]] int size() const { return static_cast<int>(refs.size()); }
+  [[nodiscard]] bool empty() const { return refs.empty(); }
+  [[nodiscard]] const Ref &getRef(int prim) const { return refs[prim]; }
+  [[nodiscard]] const vec3 &getVertex(int prim, int i) const {
+    const Ref &ref = refs[prim];
+    return meshes[ref.mesh]->getVertex(ref.triangle, i);
+  }
+  /* Light of the mesh of a triangle, -1 for plain geometry */
+  [[nodiscard]] int getLightId(int prim) const {
+    return lightIds.empty() ? -1 : lightIds[refs[prim].mesh];
+  }
+  [[nodiscard]] const std::vector<std::shared_ptr<Mesh>> &getMeshes() const { return meshes; }
+  [[nodiscard]] const std::vector<int> &getLightIds() const { return lightIds; }
+  /**
+   * fill the intersect infos of the triangle hit found by a traversal, hits on
+   * light meshes are tagged with their light
+   * @param[out] interaction output intersect infos
+   * @param[in] hit the hit, primId is the primitive id of the triangle
+   * @param[in] ray the given ray
+   */
+  void resolve(Interaction &interaction, const HitRecord &hit, const Ray &ray) const;
 
  private:
-  KdTreeNode *leftChild, *rightChild;
-  AABB box;
-  std::vector<std::shared_ptr<Triangle>> triangles;
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  std::vector<int> lightIds;  // light of every mesh, see the constructor
+  std::vector<Ref> refs;      // mesh and triangle of every primitive id
 };
 
+/**
+ * Precomputed triangles of a leaf in SoA blocks (v0 and the two edges)
+ * so that one SIMD Moller-Trumbore test handles a whole block. Unused lanes
+ * hold degenerate triangles which are never hit.
+ */
+constexpr int TRIANGLE_BLOCK_SIZE = 4;
+struct alignas(16) TriangleBlock {
+  Float v0[3][TRIANGLE_BLOCK_SIZE];
+  Float e1[3][TRIANGLE_BLOCK_SIZE];
+  Float e2[3][TRIANGLE_BLOCK_SIZE];
+  int primId[TRIANGLE_BLOCK_SIZE];  // primitive id of the triangle, -1 if unused
+};
+
+/**
+ * pack triangles into blocks
+ * @param[in] primitives all triangles
+ * @param[in] indices, count primitive ids of the triangles to pack
+ * @param[out] blocks the blocks are appended here
+ * @return index of the first block
+ */
+int packTriangleBlocks(const MeshPrimitives &primitives, const int *indices,
+                       int count, std::vector<TriangleBlock> &blocks);
+/**
+ * fill a single block, e.g. on the fly for leaves that only store indices
+ * @param[in] primitives all triangles
+ * @param[in] indices, count primitive ids of the triangles to pack, at most
+ *            TRIANGLE_BLOCK_SIZE
+ * @param[out] block the block
+ */
+void fillTriangleBlock(const MeshPrimitives &primitives, const int *indices,
+                       int count, TriangleBlock &block);
+/**
+ * closest hit of a ray among the triangles of a block
+ * @param[in] block the triangle block
+ * @param[in] ray the given ray, only hits in [ray.tMin, ray.tMax] count
+ * @param[out] t, u, v distance and barycentric weights of the hit
+ * @param[in] laneMask only the lanes set here are tested
+ * @return the hit lane, -1 if nothing is hit
+ */
+int intersectTriangleBlock(const TriangleBlock &block, const Ray &ray, Float &t,
+                           Float &u, Float &v,
+                           int laneMask = (1 << TRIANGLE_BLOCK_SIZE) - 1);
+/**
+ * closest hit among the triangles of a leaf, the loop every traversal runs
+ * at its leaves whatever the leaves store
+ * @param[in] blockAt returns the b-th block of the leaf
+ * @param[in] count number of triangles of the leaf
+ * @param[in,out] ray only hits before ray.tMax count, tMax is clipped to the hit
+ * @param[out] hit t, primId, u and v of the hit, untouched if nothing is hit
+ * @return whether a hit was found
+ */
+template <typename BlockAt>
+inline bool intersectLeafBlocks(BlockAt &&blockAt, int count, Ray &ray, HitRecord &hit) {
+  bool found = false;
+  for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; b++) {
+    const TriangleBlock &block = blockAt(b);
+    Float t, u, v;
+    int lane = intersectTriangleBlock(block, ray, t, u, v);
+    if (lane < 0) continue;
+    ray.tMax = t;
+    hit.t = t;
+    hit.primId = block.primId[lane];
+    hit.u = u;
+    hit.v = v;
+    found = true;
+  }
+  return found;
+}
+/**
+ * any-hit test of the triangles of a leaf, light triangles do not occlude
+ * @param[in] blockAt returns the b-th block of the leaf
+ * @param[in] count number of triangles of the leaf
+ * @param[in] primitives all triangles, for their lights
+ * @param[in] segment only hits in [segment.tMin, segment.tMax] count
+ */
+template <typename BlockAt>
+inline bool occludedLeafBlocks(BlockAt &&blockAt, int count, const MeshPrimitives &primitives,
+                               const Ray &segment) {
+  for (int b = 0; b * TRIANGLE_BLOCK_SIZE < count; b++) {
+    const TriangleBlock &block = blockAt(b);
+    Float t, u, v;
+    int lane, laneMask = (1 << TRIANGLE_BLOCK_SIZE) - 1;
+    while ((lane = intersectTriangleBlock(block, segment, t, u, v, laneMask)) >= 0) {
+      if (primitives.getLightId(block.primId[lane]) < 0) return true;
+      laneMask &= ~(1 << lane);
+    }
+  }
+  return false;
+}
+/* Closest hit in a leaf of count triangles stored in the blocks from blocks[0] */
+inline bool intersectLeaf(const TriangleBlock *blocks, int count, Ray &ray, HitRecord &hit) {
+  return intersectLeafBlocks([blocks](int b) -> const TriangleBlock & { return blocks[b]; },
+                             count, ray, hit);
+}
+/* Any-hit test of a leaf of count triangles stored in the blocks from blocks[0] */
+inline bool occludedLeaf(const TriangleBlock *blocks, int count, const MeshPrimitives &primitives,
+                         const Ray &segment) {
+  return occludedLeafBlocks([blocks](int b) -> const TriangleBlock & { return blocks[b]; },
+                            count, primitives, segment);
+}
+/* Closest hit in a leaf storing primitive ids, the blocks are filled on the fly */
+inline bool intersectLeaf(const MeshPrimitives &primitives, const int *indices, int count,
+                          Ray &ray, HitRecord &hit) {
+  TriangleBlock block;
+  auto blockAt = [&](int b) -> const TriangleBlock & {
+    int first = b * TRIANGLE_BLOCK_SIZE;
+    fillTriangleBlock(primitives, indices + first, std::min(count - first, TRIANGLE_BLOCK_SIZE), block);
+    return block;
+  };
+  return intersectLeafBlocks(blockAt, count, ray, hit);
+}
+/* Any-hit test of a leaf storing primitive ids, the blocks are filled on the fly */
+inline bool occludedLeaf(const MeshPrimitives &primitives, const int *indices, int count,
+                         const Ray &segment) {
+  TriangleBlock block;
+  auto blockAt = [&](int b) -> const TriangleBlock & {
+    int first = b * TRIANGLE_BLOCK_SIZE;
+    fillTriangleBlock(primitives, indices + first, std::min(count - first, TRIANGLE_BLOCK_SIZE), block);
+    return block;
+  };
+  return occludedLeafBlocks(blockAt, count, primitives, segment);
+}
+/**
+ * recompute the boxes of all interior nodes bottom-up, the leaf boxes must be
+ * up to date. Children always follow their parent in the flattened order, so
+ * one backward sweep is enough.
+ */
+void refitInteriorNodes(std::vector<LinearKdTreeNode> &nodes);
+/**
+ * SAH cost of a flattened tree, relative to the area of its root
+ */
+Float computeSahCost(const std::vector<LinearKdTreeNode> &nodes);
+
+/**
+ * Statistics of a built acceleration structure, to compare builders and
+ * parameters by more than the render time
+ */
+struct AccelStats {
+  std::string type;
+  int primitives = 0;
+  int references = 0;  // primitives in the leaves, more with spatial splits
+  int nodes = 0;
+  int leaves = 0;
+  int maxDepth = 0;
+  Float averageDepth = 0;  // of the leaves
+  Float sahCost = 0;       // relative to the area of the root
+  size_t memoryBytes = 0;  // nodes and leaf data
+  std::vector<int> leafSizeHistogram;  // number of leaves of every size
+  std::vector<std::pair<std::string, double>> phaseTimes;  // milliseconds
+
+  /* Count a leaf of size primitives at depth */
+  void addLeaf(int size, int depth);
+  /* Record the time since start as a build phase and restart the clock */
+  void addPhase(const std::string &name,
+                std::chrono::high_resolution_clock::time_point &start);
+  /* Format as a JSON object, lines after the first start with indent */
+  [[nodiscard]] std::string toJson(const std::string &indent = "") const;
+};
+/**
+ * shape and SAH cost of a flattened tree, the rest is up to the caller
+ */
+AccelStats computeTreeStats(const std::vector<LinearKdTreeNode> &nodes);
+/**
+ * check a flattened tree read from a snapshot before it is traversed: the
+ * children of every node follow it and have no other parent, no leaf is
+ * deeper than KD_MAX_DEPTH, so the traversal stacks suffice, and every leaf
+ * stays inside the array it refers to
+ * @param[in] entries size of the array the leaves refer to
+ * @param[in] primitivesPerEntry primitives an entry holds, e.g. TRIANGLE_BLOCK_SIZE
+ */
+bool isValidTree(const std::vector<LinearKdTreeNode> &nodes, size_t entries,
+                 int primitivesPerEntry);
+
+/**
+ * How the binary tree of an acceleration structure is built
+ */
+enum class BuildMethod {
+  SAH,   // binned SAH
+  SBVH,  // binned SAH with spatial splits, see KdTreeBuilder::enableSpatialSplits
+  LBVH   // Morton code order, see KdTreeBuilder::buildMorton
+};
+
+/**
+ * Binned SAH builder of the flattened k-d tree
+ * Works on primitive bounds only and partitions one shared primitive array in
+ * place, nodes are emitted in depth-first order.
+ * With spatial splits enabled (SBVH) a node may also be split by a plane
+ * through its box, triangles crossing the plane are then referenced by both
+ * children with the box of their clipped part. This needs the triangles
+ * themselves, and the leaves may reference a triangle more than once.
+ */
+class KdTreeBuilder {
+ public:
+  /**
+   * @param[in] bounds the bounding box of every primitive
+   */
+  explicit KdTreeBuilder(const std::vector<AABB> &bounds);
+  /**
+   * allow spatial splits, at most SBVH_MAX_DUPLICATION times the number of
+   * triangles extra references are created
+   * @param[in] primitives the triangles the bounds belong to
+   */
+  void enableSpatialSplits(const MeshPrimitives &primitives);
+  /**
+   * build the tree
+   * @param[out] nodes the flattened nodes, nodes[0] is the root
+   * @param[out] primitiveIndices primitive indices referenced by the leaves
+   */
+  void build(std::vector<LinearKdTreeNode> &nodes,
+             std::vector<int> &primitiveIndices);
+  /**
+   * build a linear BVH instead, the primitives are sorted along a Morton
+   * curve of their centers and a node is split where the codes of its
+   * primitives first differ. Much faster than the SAH build, but the tree is
+   * worse, e.g. for previews and rebuilds of animated meshes.
+   * @param[out] nodes the flattened nodes, nodes[0] is the root
+   * @param[out] primitiveIndices primitive indices referenced by the leaves
+   */
+  void buildMorton(std::vector<LinearKdTreeNode> &nodes,
+                   std::vector<int> &primitiveIndices);
+
+ private:
+  struct BuildPrimitive {
+    AABB box;
+    vec3 center;
+    int index;
+  };
+  struct ObjectSplit {
+    int axis = -1;
+    int bin = -1;
+    int nBins = 0;
+    Float cost = INF;  // surface area times count summed over the children
+    AABB leftBox, rightBox;
+  };
+  struct SpatialSplit {
+    int axis = -1;
+    Float position = 0;
+    Float cost = INF;
+  };
+
+  /* Build the node over prims[start, end) and its subtree into nodes */
+  void buildRecursive(int start, int end, int depth,
+                      std::vector<LinearKdTreeNode> &nodes);
+  /* Find the best binned SAH split, return false if a leaf is cheaper */
+  bool findSplit(int start, int end, const AABB &box, const AABB &centerBox,
+                 int &axis, int &mid);
+  /* Best binned SAH split of refs by their centers */
+  static ObjectSplit findObjectSplit(const BuildPrimitive *refs, int n,
+                                     const AABB &centerBox);
+  /* Partition refs by an object split, return the size of the left part */
+  static int partitionObjects(BuildPrimitive *refs, int n, const AABB &centerBox,
+                              const ObjectSplit &split);
+  /* Whether a leaf is cheaper than a split of the given cost */
+  static bool leafIsCheaper(Float cost, int n, const AABB &box);
+
+  /**
+   * Build a node and its subtree with spatial splits, leaves append to indices
+   * budget is the number of extra references the subtree may add, a split
+   * hands what is left of it to its children in proportion to their sizes,
+   * so the tree does not depend on the order the tasks run in
+   */
+  void buildSpatialRecursive(std::vector<BuildPrimitive> refs, int depth, int budget,
+                             std::vector<LinearKdTreeNode> &nodes,
+                             std::vector<int> &indices);
+  /* Best binned SAH split of refs by planes through box */
+  SpatialSplit findSpatialSplit(const std::vector<BuildPrimitive> &refs,
+                                const AABB &box) const;
+  /* Box of the part of a reference between lo and hi along axis */
+  AABB clipReference(const BuildPrimitive &ref, int axis, Float lo, Float hi) const;
+
+  /* Build the node over the Morton sorted primitives [start, end) and its subtree */
+  void buildMortonRecursive(const std::vector<uint64_t> &codes,
+                            const std::vector<int> &order, int start, int end,
+                            int depth, std::vector<LinearKdTreeNode> &nodes) const;
+
+  const std::vector<AABB> &bounds;
+  std::vector<BuildPrimitive> prims;
+  const MeshPrimitives *primitives = nullptr;
+  Float rootArea = 0;
+};
+
+/**
+ * build the binary tree of an accelerator over its triangles
+ * @param[in] bounds the bounding box of every triangle
+ * @param[in] primitives the triangles, needed for spatial splits
+ * @param[in] method the builder
+ * @param[out] nodes the flattened nodes, nodes[0] is the root
+ * @param[out] primitiveIndices primitive indices referenced by the leaves
+ */
+void buildTree(const std::vector<AABB> &bounds, const MeshPrimitives &primitives,
+               BuildMethod method, std::vector<LinearKdTreeNode> &nodes,
+               std::vector<int> &primitiveIndices);
+/* Suffix of the statistics type of an accelerator built with method */
+std::string buildMethodSuffix(BuildMethod method);
+
 class KdTreeAccel : public Geometry {
  public:
-  explicit KdTreeAccel(const std::vector<std::shared_ptr<Triangle>> &triangles);
-  bool intersect(Interaction &interaction, const Ray &ray) const override;
+  /**
+   * @param[in] primitives the triangles, including those of area lights
+   * @param[in] method how the tree is built, see KdTreeBuilder
+   */
+  explicit KdTreeAccel(MeshPrimitives primitives, BuildMethod method = BuildMethod::SAH);
+  using Geometry::intersect;
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  void intersect(const RayPacket<RAY_PACKET_SIZE> &packet,
+                 HitPacket<RAY_PACKET_SIZE> &hits) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
+  /**
+   * same as intersectHit, but without a traversal stack. The tree is walked
+   * along parent links by a three-state automaton (entered from the parent,
+   * from the sibling or from a child), so the whole state of a ray is its
+   * current node and state, e.g. for many rays in flight at once. Children
+   * are still visited front to back.
+   */
+  bool intersectHitStackless(HitRecord &hit, const Ray &ray) const;
+  /* same as occluded without a traversal stack, see intersectHitStackless */
+  bool occludedStackless(const Ray &ray, Float maxDist) const;
   vec3 getNormal() const override { return vec3::Zero(); }
   vec3 getCenter() const override { return vec3::Zero(); }
+  /* Get the box of all triangles */
+  [[nodiscard]] AABB getBounds() const { return nodes.empty() ? AABB() : nodes[0].box; }
+  /* Memory of the nodes and the leaf triangles per triangle */
+  [[nodiscard]] Float getBytesPerTriangle() const;
+  /* Statistics of the last build */
+  [[nodiscard]] const AccelStats &getStats() const { return stats; }
+  /* Get the triangles, including the light ids of their meshes */
+  [[nodiscard]] const MeshPrimitives &getPrimitives() const { return primitives; }
+  /**
+   * update the tree after the vertices of the triangle meshes moved, the
+   * topology of the tree is kept and only the boxes are recomputed. Once the
+   * SAH cost grew past REFIT_REBUILD_RATIO times the cost of the last build
+   * the tree is rebuilt instead.
+   * @return whether the tree was rebuilt
+   */
+  bool refit();
+  /* Write the triangles and the built tree into a snapshot */
+  void save(SnapshotWriter &out) const;
+  /* Read a tree written by save, nothing is rebuilt, nullptr if the tree is damaged */
+  static std::shared_ptr<KdTreeAccel> load(SnapshotReader &in);
  private:
-  std::unique_ptr<KdTreeNode> root{};
+  KdTreeAccel() = default;
+  /* Build the tree and the triangle blocks from scratch */
+  void build();
+  /* Fill stats from the built tree, keeping the phase times */
+  void updateStats();
+  /* Record the parent of every node for the stackless traversal */
+  void linkParents();
+
+  MeshPrimitives primitives;
+  std::vector<LinearKdTreeNode> nodes;
+  std::vector<int> parents;           // parent of every node, -1 for the root
+  std::vector<TriangleBlock> blocks;  // leaf triangles, see primitivesOffset
+  Float buildCost = 0;                // SAH cost right after the last build
+  BuildMethod method = BuildMethod::SAH;
+  AccelStats stats;
 };
 #endif  // CS171_HW4_INCLUDE_ACCEL_H_
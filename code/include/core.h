@@ -39,7 +39,32 @@ constexpr int DEFAULT_RENDER_ROUND = static_cast <int>(10);
 constexpr int DEFAULT_PHOTON_NUM = static_cast <int>(20000);
 constexpr Float DEFAULT_INITIAL_RAIUS = static_cast <int>(5);
 constexpr Float DEFAULT_RE_DECAY = static_cast <Float>(0.8);
+// fraction of the new photons a pixel keeps each round in progressive mode
+constexpr Float DEFAULT_SPPM_ALPHA = static_cast <Float>(0.7);
+// photons of a radiance estimate of the two-pass photon map
+constexpr int DEFAULT_PHOTON_MAP_K = static_cast <int>(64);
+// photons are traced in chunks of this size, each chunk keeps its own buffer
+constexpr int PHOTON_TRACE_CHUNK_SIZE = static_cast <int>(1024);
 
+//constexpr for acceleration structure
+constexpr int SAH_BIN_NUM = static_cast<int>(16);
+constexpr int KD_MAX_DEPTH = static_cast<int>(60);
+constexpr int KD_MAX_LEAF_SIZE = static_cast<int>(64);
+constexpr int KD_PARALLEL_BUILD_SIZE = static_cast<int>(4096);
+constexpr Float SAH_TRAVERSAL_COST = static_cast<Float>(0.125);
+constexpr Float SAH_INTERSECT_COST = static_cast<Float>(1.0);
+constexpr int RAY_PACKET_SIZE = static_cast<int>(8);
+// spatial splits may add at most this fraction of extra triangle references
+constexpr Float SBVH_MAX_DUPLICATION = static_cast<Float>(0.3);
+// spatial splits are only tried if the children of the best object split
+// overlap by this fraction of the root area
+constexpr Float SBVH_OVERLAP_THRESHOLD = static_cast<Float>(1e-5);
+// a refit tree is rebuilt once its SAH cost exceeds the built one by this factor
+constexpr Float REFIT_REBUILD_RATIO = static_cast<Float>(1.3);
+// leaves of the Morton code builder hold at most this many primitives
+constexpr int LBVH_LEAF_SIZE = static_cast<int>(4);
+// above this many primitives Morton codes have 63 instead of 30 bits
+constexpr int LBVH_LONG_CODE_SIZE = static_cast<int>(1 << 20);
 
 template <typename T>
 using Vector3 = Eigen::Matrix<T, 3, 1>;
@@ -62,6 +87,8 @@ struct Interaction;
 class Light;
 class AreaLight;
 class BRDF;
+class SnapshotWriter;
+class SnapshotReader;
 
 
 /**
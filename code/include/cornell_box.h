@@ -0,0 +1,31 @@
+#ifndef CS171_HW4_INCLUDE_CORNELL_BOX_H_
+#define CS171_HW4_INCLUDE_CORNELL_BOX_H_
+#include <camera.h>
+#include <scene.h>
+#include <string>
+
+/**
+ * find a file relative to the working directory or up to depth - 1 parent
+ * directories above it
+ * @return the path that exists, target if none does
+ */
+std::string getPath(const std::string &target, int depth = 5);
+
+/**
+ * make the camera of a scene
+ * @param[in] id the scene, see genCornellBoxScene
+ * @param[in] res resolution of the film
+ */
+std::shared_ptr<Camera> genCamera(int id = 0,
+                                  const vec2i &res = vec2i(512, 512));
+/**
+ * build a scene: 0 is the Cornell box, 1 to 5 replace its boxes with OBJ
+ * meshes, 6 puts a mesh on a large floor
+ * @param[in] id the scene
+ * @param[in] snapshotPath if not empty, the prepared geometry and accelerator
+ *            are mapped from this snapshot when its key matches, otherwise
+ *            they are built and written there
+ */
+std::shared_ptr<Scene> genCornellBoxScene(int id = 0, const std::string &snapshotPath = "");
+
+#endif  // CS171_HW4_INCLUDE_CORNELL_BOX_H_
@@ -30,4 +30,15 @@ struct Film {
   std::vector<vec3> pixels;  // pixels data
 };
 
+/**
+ * write per-pixel values, e.g. traversal costs, as a false-colour image
+ * scaled to the largest value and as a raw float buffer
+ * @param[in] values one value per pixel, in the layout of Film::pixels,
+ *            nothing is written if the size does not match the resolution
+ * @param[in] resolution the resolution of the film
+ * @param[in] basePath writes basePath.png and basePath.pfm
+ */
+void writeHeatmap(const std::vector<float> &values, const vec2i &resolution,
+                  const std::string &basePath);
+
 #endif  // CS171_HW3_INCLUDE_FILM_H_
@@ -1,6 +1,7 @@
 #ifndef CS171_HW3_INCLUDE_GEOMETRY_H_
 #define CS171_HW3_INCLUDE_GEOMETRY_H_
 #include <interaction.h>
+#include <ray.h>
 #include <brdf.h>
 /**
  * Base class of geometries
@@ -10,17 +11,48 @@ class Geometry {
   Geometry() = default;
   virtual ~Geometry() = default;
   /**
-   * ray-geometry intersect
+   * ray-geometry intersect, the closest hit is resolved into the full
+   * intersect infos
    * @param[out] interaction output intersect infos
    * @param[in] ray the given ray
    * @return whether ray hit the geometry
    */
-  virtual bool intersect(Interaction &interaction, const Ray &ray) const = 0;
+  virtual bool intersect(Interaction &interaction, const Ray &ray) const;
+  /**
+   * closest hit of a ray, only the hit record is written and only on a hit
+   * @param[out] hit the closest hit in [ray.tMin, ray.tMax]
+   * @param[in] ray the given ray
+   * @return whether ray hit the geometry
+   */
+  virtual bool intersectHit(HitRecord &hit, const Ray &ray) const = 0;
+  /**
+   * fill the intersect infos of a hit found by intersectHit
+   * @param[out] interaction output intersect infos
+   * @param[in] hit the hit
+   * @param[in] ray the ray passed to intersectHit
+   */
+  virtual void resolveHit(Interaction &interaction, const HitRecord &hit,
+                          const Ray &ray) const = 0;
+  /**
+   * intersect a packet of rays, by default every ray is traced on its own
+   * @param[in] packet the given rays
+   * @param[out] hits output intersect infos of every ray
+   */
+  virtual void intersect(const RayPacket<RAY_PACKET_SIZE> &packet,
+                         HitPacket<RAY_PACKET_SIZE> &hits) const;
+  /**
+   * any-hit test of a ray segment, no intersect infos are computed
+   * @param[in] ray the given ray
+   * @param[in] maxDist the end of the segment (in units of t)
+   * @return whether anything is hit between ray.tMin and maxDist
+   */
+  virtual bool occluded(const Ray &ray, Float maxDist) const;
   /**
    * set the mateial of a geometry
    * @param[in] mat the material
    */
   void setMaterial(std::shared_ptr<BRDF> mat);
+  [[nodiscard]] const std::shared_ptr<BRDF> &getMaterial() const { return material; }
   virtual vec3 getNormal() const = 0;
   virtual vec3 getCenter() const = 0;
  protected:
@@ -51,43 +83,55 @@ struct TriangleMesh {
 };
 
 /**
- * triangle geometry class
+ * triangle mesh geometry
+ * A mesh is registered as one geometry with one material, its triangles are
+ * referred to by their index in the mesh instead of by an object each.
  */
-class Triangle : public Geometry {
+class Mesh : public Geometry {
  public:
   /**
-   * construct a triangle with a triangle in the mesh
    * @param[in] mesh the given triangle mesh
-   * @param[in] v v[0], v[1], v[2] are the index value of the tringle
-   * @param[in] mat material
+   * @param[in] mat material of every triangle
+   */
+  explicit Mesh(std::shared_ptr<TriangleMesh> mesh, std::shared_ptr<BRDF> mat);
+  /**
+   * closest hit among all triangles of the mesh
+   * @param[out] hit distance and barycentric weights of the hit, primId is
+   *             the index of the triangle in the mesh
+   * @param[in] ray the given ray
+   * @return whether ray hit the mesh
    */
-  explicit Triangle(std::shared_ptr<TriangleMesh> mesh, const int *v,
-                    std::shared_ptr<BRDF> mat);
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
   /**
-   * ray-triangle intersect
+   * fill the intersect infos of a known hit
    * @param[out] interaction output intersect infos
    * @param[in] ray the given ray
-   * @return whether ray hit the triangle
+   * @param[in] triangle index of the hit triangle in the mesh
+   * @param[in] t distance of the hit
+   * @param[in] u, v barycentric weights of vertex 1 and vertex 2
    */
-  bool intersect(Interaction &interaction, const Ray &ray) const override;
-  vec3 getCenter() const override{ return center; }
-  [[nodiscard]] const vec3 &getVertex(int i) const {
+  void computeInteraction(Interaction &interaction, const Ray &ray,
+                          int triangle, Float t, Float u, Float v) const;
+  /* Get the center of the vertices */
+  vec3 getCenter() const override { return center; }
+  /* Get the averaged vertex normal of the first triangle, e.g. of a flat light */
+  vec3 getNormal() const override;
+  [[nodiscard]] const std::shared_ptr<TriangleMesh> &getMesh() const { return mesh; }
+  [[nodiscard]] int countTriangles() const { return mesh->nTriangles; }
+  [[nodiscard]] const vec3 &getVertex(int triangle, int i) const {
     assert(0 <= i && i <= 2);
-    return mesh->p[v[i]];
-  }
-
-  vec3 getNormal() const override{
-      return (mesh->n[v[0]] + mesh->n[v[1]] + mesh->n[v[2]])/3;
+    return mesh->p[mesh->indices[3 * triangle + i]];
   }
 
- 
-private:
+ private:
   std::shared_ptr<TriangleMesh> mesh;
-  const int *v;  // the index of the triangle (v[0], v[1], v[2])
-  vec3 center; // the centre point coordinate for the triangle
+  vec3 center;  // the centre point of the vertices
 };
 
-// make a triangle mesh
+// make a triangle mesh, registered as a single Mesh geometry
 std::vector<std::shared_ptr<Geometry>> makeTriangleMesh(
     const std::vector<int> &indices, int nVertices, const std::vector<vec3> &p,
     const std::vector<vec3> &n, const std::vector<vec2> &uv,
@@ -0,0 +1,115 @@
+#ifndef CS171_HW4_INCLUDE_INSTANCE_H_
+#define CS171_HW4_INCLUDE_INSTANCE_H_
+#include <accel.h>
+
+using Matrix3x3 = Eigen::Matrix<Float, 3, 3>;
+
+/**
+ * A placement of a shared object in the scene
+ * The object is an acceleration structure over the triangles of a mesh in
+ * object space, built once and shared by every instance of the mesh. A ray
+ * is moved into object space instead of moving the triangles into world
+ * space. The direction is not normalized there, so t is the same in both
+ * spaces.
+ */
+class Instance : public Geometry {
+ public:
+  /**
+   * @param[in] object the shared acceleration structure in object space
+   * @param[in] objectBounds the box of the object in object space
+   * @param[in] objectToWorld an affine transform
+   */
+  explicit Instance(std::shared_ptr<Geometry> object, const AABB &objectBounds,
+                    const Matrix4x4 &objectToWorld);
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
+  vec3 getNormal() const override { return vec3::Zero(); }
+  vec3 getCenter() const override { return bounds.getCenter(); }
+  /* Get the box of the instance in world space */
+  [[nodiscard]] const AABB &getBounds() const { return bounds; }
+  [[nodiscard]] const std::shared_ptr<Geometry> &getObject() const { return object; }
+  /* Recompute the world space box after the object changed */
+  void updateBounds(const AABB &objectBounds);
+  /* Write the instance into a snapshot, its object only the first time */
+  void save(SnapshotWriter &out) const;
+  /* Read an instance written by save */
+  static std::shared_ptr<Instance> load(SnapshotReader &in);
+
+ private:
+  /* Move a world space ray into object space */
+  [[nodiscard]] Ray toObject(const Ray &ray) const;
+
+  std::shared_ptr<Geometry> object;
+  Matrix3x3 linear;     // object to world, without the translation
+  Matrix3x3 invLinear;  // world to object, without the translation
+  vec3 translation;
+  bool identity;        // rays need not be transformed
+  AABB bounds;          // world space
+};
+
+/**
+ * Top level acceleration structure over instances
+ * Uses the same flattened SAH tree as KdTreeAccel, leaves refer to instances
+ * which in turn traverse their own object.
+ */
+class InstanceAccel : public Geometry {
+ public:
+  explicit InstanceAccel(const std::vector<std::shared_ptr<Instance>> &instances);
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
+  vec3 getNormal() const override { return vec3::Zero(); }
+  vec3 getCenter() const override { return vec3::Zero(); }
+  /**
+   * refit every shared object once, then the boxes of the instances and of
+   * the top level tree, see KdTreeAccel::refit
+   * @return false if an object is not a KdTreeAccel and cannot be refit, the
+   *         structure must be rebuilt by the caller then
+   */
+  bool refit();
+  /* Statistics of the last build of the top level tree */
+  [[nodiscard]] const AccelStats &getStats() const { return stats; }
+  /* Get the instances */
+  [[nodiscard]] const std::vector<std::shared_ptr<Instance>> &getInstances() const {
+    return instances;
+  }
+  /* Write the instances and the built tree into a snapshot */
+  void save(SnapshotWriter &out) const;
+  /* Read a tree written by save, nothing is rebuilt, nullptr if the tree is damaged */
+  static std::shared_ptr<InstanceAccel> load(SnapshotReader &in);
+
+ private:
+  InstanceAccel() = default;
+  /* Build the top level tree from the boxes of the instances */
+  void build();
+  /* Fill stats from the built tree, keeping the phase times */
+  void updateStats();
+
+  std::vector<std::shared_ptr<Instance>> instances;
+  std::vector<LinearKdTreeNode> nodes;
+  std::vector<int> instanceIndices;  // instances referenced by the leaves
+  Float buildCost = 0;               // SAH cost right after the last build
+  AccelStats stats;
+};
+
+// build the shared object of a triangle mesh, e.g. the result of makeObjMesh,
+// geometries that are not meshes are skipped
+std::shared_ptr<KdTreeAccel> makeInstanceObject(
+    const std::vector<std::shared_ptr<Geometry>> &mesh);
+
+// place a built acceleration structure over triangles where it is, nullptr
+// for any other geometry
+std::shared_ptr<Instance> makeIdentityInstance(const std::shared_ptr<Geometry> &object);
+
+// place a shared object in the scene
+std::shared_ptr<Instance> makeInstance(const std::shared_ptr<KdTreeAccel> &object,
+                                       const Matrix4x4 &objectToWorld);
+
+// place a shared object in the scene, same arguments as makeObjMesh
+std::shared_ptr<Instance> makeInstance(const std::shared_ptr<KdTreeAccel> &object,
+                                       Float scale, vec3 translation,
+                                       vec3 rotation_axis = vec3::Zero());
+#endif  // CS171_HW4_INCLUDE_INSTANCE_H_
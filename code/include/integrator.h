@@ -6,6 +6,8 @@
 #include <camera.h>
 #include <integrator.h>
 #include <viewpoints.h>
+#include <photonmap.h>
+#include <traversal_stats.h>
 /**
  * Base class of integrator
  */
@@ -27,6 +29,22 @@ class Integrator {
   virtual vec3 radiance(Scene &scene, const Ray &ray) const = 0;
  protected:
   std::shared_ptr<Camera> camera;
+#ifdef ACCEL_TRAVERSAL_STATS
+  /* Clear the traversal cost of every pixel */
+  void resetTraversalCost();
+  /**
+   * add the traversal work counted in a lane to a pixel
+   * @param[in] dx, dy the pixel
+   * @param[in] lane the lane of the camera ray in its packet
+   * @param[in] weight the share of the ray among the rays of the pixel
+   */
+  void addTraversalCost(int dx, int dy, int lane, Float weight);
+  /* Write the nodes and triangles heatmaps, see writeHeatmap */
+  void writeTraversalCost() const;
+
+  std::vector<float> nodeCost;      // nodes visited per camera ray of every pixel
+  std::vector<float> triangleCost;  // triangles tested per camera ray
+#endif
 };
 
 /**
@@ -38,11 +56,23 @@ public:
   PathIntegrator(std::shared_ptr<Camera> camera, int max_depth, int spp = 1);
   void render(Scene &scene) override;
   vec3 radiance(Scene &scene, const Ray &ray) const override;
+  vec3 radiance(Scene &scene, const Ray &ray, Interaction &interaction, bool hit) const;
 private:
 	int max_depth;
 	int spp;
 };
 
+/**
+ * Statistics a pixel keeps over the rounds of stochastic progressive photon
+ * mapping (Hachisuka and Jensen 2009)
+ */
+struct PixelStatistics {
+  Float radius2 = 0;          // squared gather radius R^2
+  Float photons = 0;          // accumulated photon count N
+  vec3 tau{vec3::Zero()};     // accumulated flux, scaled to the current radius
+  vec3 direct{vec3::Zero()};  // emission seen by the camera rays, summed over the rounds
+};
+
 class PhotonIntegrator : public Integrator {
 public:
 	PhotonIntegrator(std::shared_ptr<Camera> camera);
@@ -51,23 +81,97 @@ public:
 	void render(Scene & scene);
 	vec3 radiance(Scene& scene, const Ray& ray) const override;
 	void setRenderround(int round);
-	vec3 RayTracing(Scene& scene, const Ray& ray, double strength, int x, int y, int depth, const vec3 color);
+	vec3 RayTracing(Scene& scene, const Ray& ray, std::vector<ViewPoint>& points, double strength, int x, int y, int depth, const vec3 color);
+	vec3 RayTracing(Scene& scene, const Ray& ray, Interaction& interaction, bool hit, std::vector<ViewPoint>& points, double strength, int x, int y, int depth, const vec3 color); // with the first hit already known
   void PhotonTracing(Scene& scene, const Ray& ray, const int depth, const vec3 radi, const Float current_radius);
-	void buildKdPointTree(std::vector<std::shared_ptr<ViewPoint>> viewpoints); // build KdPointTree from view points
+	void buildKdPointTree(const std::vector<ViewPoint>& viewpoints); // build KdPointTree from view points
+	void mergeViewPoints(); // concatenate column_points into view_points in column order
+	void gatherFlux(); // add the flux of every view point to its pixel in pixels_data
+	/**
+	 * choose the structure the photons search the view points with
+	 * @param[in] enable a hash grid rebuilt every round if true (the default),
+	 *            the KdPointTree otherwise
+	 */
+	void setHashGrid(bool enable);
+	/**
+	 * switch to stochastic progressive photon mapping: every pixel keeps its
+	 * own radius, photon count and flux, and shrinks its radius by the
+	 * photons it gathered instead of the global re_decay schedule
+	 * @param[in] enable progressive mode if true
+	 * @param[in] alpha fraction of the new photons kept every round, in (0, 1)
+	 */
+	void setProgressive(bool enable, Float alpha = DEFAULT_SPPM_ALPHA);
 private:
+	/* Set the gather radius of every view point to the one of its pixel, return the largest */
+	Float assignPixelRadii();
+	/* Update the statistics of every pixel with the photons of the round, see setProgressive */
+	void updatePixelStatistics();
+
 	int render_round;
 	int photon_num;
 	int max_depth;
 	int bounceMaxDepth;
-	std::vector<std::shared_ptr<ViewPoint>> view_points; // view points stored
+	std::vector<ViewPoint> view_points; // view points stored
+	std::vector<std::vector<ViewPoint>> column_points; // view points found in every film column, merged into view_points
+	std::vector<size_t> column_offsets; // view points of column x are [column_offsets[x], column_offsets[x + 1])
 	std::shared_ptr<KdPointTree> kd_point_tree; // kdpoint tree build from view points
+	ViewPointGrid view_point_grid; // hash grid over the view points, cells sized by the round radius
+	bool use_hash_grid = true; // search view points in view_point_grid instead of kd_point_tree
+	bool progressive = false; // per-pixel radii and statistics, see setProgressive
+	Float alpha = DEFAULT_SPPM_ALPHA; // fraction of new photons kept in progressive mode
+	std::vector<PixelStatistics> pixel_stats; // statistics of every pixel in progressive mode
 	std::vector<vec3> pixels_data; // the rgb data for the pixels on the film. (update every round)
 	Float initial_radius; //initial radius for photon tracing.
 	Float re_decay; // the decay for radius and energy every round.
 	int spp; //sample per pixel in ray tracing pass
 };
 
+/**
+ * Two-pass photon mapping (Jensen 1996)
+ * The photons are traced once into a PhotonMap, the camera pass estimates
+ * the radiance at the first diffuse surface from the k nearest photons.
+ * Photons do not depend on the camera, so a map can be handed to the
+ * integrators of other cameras with setPhotonMap.
+ */
+class PhotonMapIntegrator : public Integrator {
+public:
+  /**
+   * @param[in] camera the camera to render with
+   * @param[in] photon_num photons emitted by all lights together
+   * @param[in] k photons of a radiance estimate
+   * @param[in] max_radius largest radius a radiance estimate gathers photons in
+   * @param[in] max_depth bounces of a photon and of a camera path
+   * @param[in] spp samples per pixel
+   */
+  PhotonMapIntegrator(std::shared_ptr<Camera> camera, int photon_num, int k, Float max_radius,
+                      int max_depth, int spp = 1);
+  /* Render the scene, tracing the photons first unless a map is set */
+  void render(Scene &scene) override;
+  vec3 radiance(Scene &scene, const Ray &ray) const override;
+  vec3 radiance(Scene &scene, const Ray &ray, Interaction &interaction, bool hit) const;
+  /* Trace photon_num photons through the scene and balance them into a new map */
+  void buildPhotonMap(Scene &scene);
+  [[nodiscard]] std::shared_ptr<PhotonMap> getPhotonMap() const { return photon_map; }
+  /* Use a map traced before, e.g. by the integrator of another camera */
+  void setPhotonMap(std::shared_ptr<PhotonMap> map) { photon_map = std::move(map); }
+
+private:
+  /* Follow a photon, storing it at every diffuse surface it meets */
+  void tracePhoton(Scene &scene, const Ray &ray, int depth, const vec3 &power, std::vector<Photon> &photons) const;
+  /**
+   * estimate the radiance leaving a diffuse surface from the nearest photons
+   * @param[in] interaction the surface point
+   * @param[in] weight throughput of the camera path times the BRDF
+   */
+  vec3 estimate(const Interaction &interaction, const vec3 &weight) const;
 
+  int photon_num;
+  int k;
+  Float max_radius;
+  int max_depth;
+  int spp;
+  std::shared_ptr<PhotonMap> photon_map;
+};
 
 
 std::shared_ptr<Integrator> makePathIntegrator(std::shared_ptr<Camera> camera);
@@ -79,4 +183,7 @@ std::shared_ptr<Integrator> makePhotonIntegrator(std::shared_ptr<Camera> camera)
 std::shared_ptr<Integrator> makePhotonIntegrator(std::shared_ptr<Camera> camera, int render_round, 
 	int photon_num, Float initial_radius, Float re_decay, int bouncemaxdepth, int max_depth, int spp = 1);
 
+std::shared_ptr<Integrator> makePhotonMapIntegrator(std::shared_ptr<Camera> camera, int photon_num,
+	int k = DEFAULT_PHOTON_MAP_K, Float max_radius = DEFAULT_INITIAL_RAIUS, int max_depth = MAX_DEPTH, int spp = 1);
+
 #endif  // CS171_HW3_INCLUDE_INTEGRATOR_H_
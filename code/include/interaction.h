@@ -20,8 +20,9 @@ struct Interaction {
   vec3 normal;
   // UV coordinate of intersection point (if existed)
   vec2 uv;
-  // Phong lighting model at the intersected point (if existed)
-  std::shared_ptr<BRDF> brdf;
+  // Phong lighting model at the intersected point (if existed), owned by the
+  // geometry, so copies of an interaction do not touch a reference count
+  BRDF *brdf;
   /* Direction of incoming radiance */
   Eigen::Vector3f wi;
   /* Direction of outcoming radiance */
@@ -30,8 +31,34 @@ struct Interaction {
   Type type;
   // if hit light, record the emission
   vec3 emission;
+  // if hit light, index of the light in the scene
+  int lightId;
 
-  Interaction() : entryDist(-1), type(Type::NONE) {}
+  Interaction() : entryDist(-1), brdf(nullptr), type(Type::NONE), lightId(-1) {}
+};
+
+/**
+ * Closest hit found by a traversal, turned into an Interaction only once the
+ * traversal is finished, see Geometry::resolveHit
+ */
+struct HitRecord {
+  // Distance (in units of t) to intersection point
+  Float t = -1;
+  // Primitive of the accelerator that was hit
+  int primId = -1;
+  // Instance of the top level tree that was hit, -1 without instances
+  int instanceId = -1;
+  // Barycentric weights of vertex 1 and vertex 2
+  Float u = 0, v = 0;
+};
+
+/**
+ * Intersect infos of every ray in a RayPacket
+ */
+template <int Size>
+struct HitPacket {
+  Interaction interactions[Size];
+  bool hit[Size];
 };
 
 #endif  // CS171_HW3_INCLUDE_INTERACTION_H_
@@ -31,6 +31,13 @@ class Light {
    */
   virtual bool intersect(Interaction &interaction, const Ray &ray) = 0;
   virtual Ray generateRay(vec3 & light_energy) = 0;
+  /**
+   * @return the emissive triangles of the light, they are put into the
+   *         acceleration structure of the scene
+   */
+  [[nodiscard]] virtual std::vector<std::shared_ptr<Geometry>> getGeometries() const {
+    return {};
+  }
 };
 
 /**
@@ -57,6 +64,9 @@ class AreaLight : public Light {
    */
   bool intersect(Interaction &interaction, const Ray &ray) override;
   Ray generateRay(vec3& light_energy) override;
+  [[nodiscard]] std::vector<std::shared_ptr<Geometry>> getGeometries() const override {
+    return geoms;
+  }
 };
 
 
@@ -0,0 +1,70 @@
+#ifndef CS171_HW4_INCLUDE_PHOTONMAP_H_
+#define CS171_HW4_INCLUDE_PHOTONMAP_H_
+#include <core.h>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A photon stored at a diffuse surface
+ */
+struct Photon
+{
+  vec3 position;
+  vec3 power;      // flux carried by the photon
+  vec3 direction;  // direction the photon arrived from the light with
+  uint8_t axis = 0;  // split axis of the photon as a node of the PhotonMap
+};
+
+/**
+ * A photon found by PhotonMap::nearest, ordered by distance so that a
+ * std heap of them keeps the farthest on top
+ */
+struct NearPhoton
+{
+  Float dist2;  // squared distance to the search position
+  int index;    // index of the photon in the map
+  bool operator<(const NearPhoton& other) const { return dist2 < other.dist2; }
+};
+
+/**
+ * Photon map of Jensen's two-pass method
+ * The photons are balanced into an implicit kd-tree in a flat array: the
+ * node of the range [lo, hi) is the median photon at (lo + hi) / 2 and its
+ * children are the ranges on both sides of it, so the tree needs no
+ * pointers and its depth is log2 of the number of photons.
+ */
+class PhotonMap
+{
+public:
+  PhotonMap() = default;
+  /* Balance the photons into the kd-tree */
+  explicit PhotonMap(std::vector<Photon> photons);
+  /**
+   * find the k photons nearest to pos
+   * @param[out] result the photons found as a max-heap on the distance, at most k
+   * @param[in] pos center of the search
+   * @param[in] k the number of photons wanted
+   * @param[in] maxDist2 squared distance beyond which photons are ignored
+   * @param[in] normal if set, only photons arriving at the front of a surface
+   *            with this normal are found, those at its back are skipped
+   *            before they take a place among the k
+   * @return squared radius of the disc holding the result, the distance of
+   *         the farthest photon if k were found, maxDist2 otherwise
+   */
+  Float nearest(std::vector<NearPhoton>& result, const vec3& pos, int k, Float maxDist2,
+                const vec3* normal = nullptr) const;
+  [[nodiscard]] const Photon& getPhoton(int index) const { return photons[index]; }
+  [[nodiscard]] size_t size() const { return photons.size(); }
+  [[nodiscard]] bool empty() const { return photons.empty(); }
+
+private:
+  /* Put the median of [lo, hi) along the axis of largest extent in the middle and recurse */
+  void balance(int lo, int hi);
+  /* Search the subtree of the range [lo, hi), maxDist2 shrinks once k photons are found */
+  void nearest(int lo, int hi, std::vector<NearPhoton>& result, const vec3& pos, int k, Float& maxDist2,
+               const vec3* normal) const;
+
+  std::vector<Photon> photons;
+};
+
+#endif  // CS171_HW4_INCLUDE_PHOTONMAP_H_
@@ -0,0 +1,122 @@
+#ifndef CS171_HW4_INCLUDE_QBVH_H_
+#define CS171_HW4_INCLUDE_QBVH_H_
+#include <accel.h>
+#include <limits>
+#include <type_traits>
+
+/**
+ * Node of a Width-wide BVH
+ * The bounds of all children are stored in SoA form, bounds[0] holds the
+ * lower and bounds[1] the upper corners, so that one SIMD slab test checks
+ * every child at once. A child is an interior node if count is 0 and child
+ * is not negative, a leaf of count triangles stored in the triangle blocks
+ * starting at child otherwise.
+ * Unused slots have child -1 and an empty box.
+ */
+template <int Width>
+struct alignas(32) WideBVHNode {
+  Float bounds[2][3][Width];
+  int child[Width];
+  int count[Width];
+};
+
+/**
+ * Wide BVH (QBVH for Width 4, OBVH for Width 8)
+ * Collapsed from the binary SAH tree of KdTreeBuilder. With SSE a 4-wide node
+ * is tested in one instruction, an 8-wide node takes one AVX instruction or
+ * two SSE ones.
+ */
+template <int Width>
+class WideBVHAccel : public Geometry {
+  static_assert(Width == 4 || Width == 8, "only 4- and 8-wide BVHs are supported");
+
+ public:
+  /* Same arguments as KdTreeAccel */
+  explicit WideBVHAccel(MeshPrimitives primitives,
+                        BuildMethod method = BuildMethod::SAH);
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
+  vec3 getNormal() const override { return vec3::Zero(); }
+  vec3 getCenter() const override { return vec3::Zero(); }
+  /* Get the box of all triangles */
+  [[nodiscard]] AABB getBounds() const { return rootBox; }
+  /* Memory of the nodes and the leaf triangles per triangle */
+  [[nodiscard]] Float getBytesPerTriangle() const;
+  /* Statistics of the build */
+  [[nodiscard]] const AccelStats &getStats() const { return stats; }
+
+ private:
+  MeshPrimitives primitives;
+  std::vector<TriangleBlock> blocks;  // leaf triangles, see WideBVHNode::child
+  std::vector<WideBVHNode<Width>> nodes;
+  AABB rootBox;
+  AccelStats stats;
+};
+
+using QBVHAccel = WideBVHAccel<4>;
+using OBVHAccel = WideBVHAccel<8>;
+
+/**
+ * Node of a 4-wide BVH with quantized child boxes
+ * The children are stored in steps of 2^exponent from the lower corner of
+ * the node box, lower bounds are rounded down and upper bounds up, so a
+ * decoded box always encloses the exact one. Power of two steps keep the
+ * decoding exact up to the final addition. A leaf child refers to count
+ * entries of the triangle index array, an interior child has count 0, an
+ * unused slot has child -1. count is as wide as LinearKdTreeNode::nPrimitives,
+ * leaves forced at KD_MAX_DEPTH may exceed KD_MAX_LEAF_SIZE by far.
+ */
+template <typename Q>
+struct QuantizedBVHNode {
+  Float origin[3];
+  int child[4];
+  Q bounds[2][3][4];
+  int8_t exponent[3];
+  uint16_t count[4];
+};
+
+/**
+ * QBVH with quantized nodes (8- or 16-bit child boxes) and leaves that only
+ * store triangle indices, for scenes whose full precision nodes and
+ * precomputed triangle blocks do not fit into memory. The boxes are decoded
+ * and the triangle blocks filled on the fly during traversal.
+ */
+template <typename Q>
+class CompressedBVHAccel : public Geometry {
+  static_assert(std::is_same<Q, uint8_t>::value || std::is_same<Q, uint16_t>::value,
+                "only 8- and 16-bit quantization is supported");
+  static_assert(std::numeric_limits<decltype(LinearKdTreeNode::nPrimitives)>::max() <=
+                    std::numeric_limits<uint16_t>::max(),
+                "leaf sizes must fit into QuantizedBVHNode::count");
+
+ public:
+  /* Same arguments as KdTreeAccel */
+  explicit CompressedBVHAccel(MeshPrimitives primitives,
+                              BuildMethod method = BuildMethod::SAH);
+  bool intersectHit(HitRecord &hit, const Ray &ray) const override;
+  void resolveHit(Interaction &interaction, const HitRecord &hit,
+                  const Ray &ray) const override;
+  bool occluded(const Ray &ray, Float maxDist) const override;
+  vec3 getNormal() const override { return vec3::Zero(); }
+  vec3 getCenter() const override { return vec3::Zero(); }
+  /* Get the box of all triangles */
+  [[nodiscard]] AABB getBounds() const { return rootBox; }
+  /* Memory of the nodes and the leaf triangles per triangle */
+  [[nodiscard]] Float getBytesPerTriangle() const;
+  /* Statistics of the build */
+  [[nodiscard]] const AccelStats &getStats() const { return stats; }
+
+ private:
+  MeshPrimitives primitives;
+  std::vector<int> primitiveIndices;  // leaf triangles, see QuantizedBVHNode::child
+  std::vector<QuantizedBVHNode<Q>> nodes;
+  AABB rootBox;
+  AccelStats stats;
+};
+
+using CompressedBVH8Accel = CompressedBVHAccel<uint8_t>;
+using CompressedBVH16Accel = CompressedBVHAccel<uint16_t>;
+
+#endif  // CS171_HW4_INCLUDE_QBVH_H_
@@ -13,6 +13,7 @@ struct Ray {
   Float tMin;
   Float tMax;
 
+  Ray() : origin(vec3::Zero()), direction(0, 0, 1), tMin(0), tMax(INF) {}
   explicit Ray(const vec3 &origin, const vec3 &direction, Float tMin = 0,
                Float tMax = INF)
       : origin(origin),
@@ -29,4 +30,20 @@ struct Ray {
   [[nodiscard]] vec3 getPoint(Float t) const { return origin + t * direction; }
 };
 
+/**
+ * A group of coherent rays traced through the scene together
+ */
+template <int Size>
+struct RayPacket {
+  Ray rays[Size];
+  int size = 0;  // number of valid rays
+
+  void add(const Ray &ray) {
+    assert(size < Size);
+    rays[size++] = ray;
+  }
+  [[nodiscard]] bool full() const { return size == Size; }
+  void clear() { size = 0; }
+};
+
 #endif  // CS171_HW3_INCLUDE_RAY_H_
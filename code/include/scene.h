@@ -2,6 +2,20 @@
 #define CS171_HW3_INCLUDE_SCENE_H_
 #include <light.h>
 #include <geometry.h>
+#include <accel.h>
+#include <cstdint>
+#include <string>
+
+/**
+ * Acceleration structures the scene can be built with
+ */
+enum class AccelType {
+  KD_TREE,  // binary SAH tree
+  QBVH,     // 4-wide BVH with SIMD box tests
+  OBVH,     // 8-wide BVH with SIMD box tests
+  CBVH8,    // QBVH with 8-bit quantized boxes and index leaves, for large scenes
+  CBVH16    // QBVH with 16-bit quantized boxes and index leaves
+};
 
 class Scene {
  protected:
@@ -10,6 +24,13 @@ class Scene {
   std::vector<std::shared_ptr<Light>> lights;
   std::shared_ptr<Geometry> accel{};
   bool hasAccel{};
+  AccelType accelType{AccelType::KD_TREE};  // the type accel was built with
+  BuildMethod buildMethod{BuildMethod::SAH};
+
+  /* Number of lights, the single light counts if lights is empty */
+  [[nodiscard]] int countLights() const;
+  /* Get a light by the index used to tag light hits */
+  [[nodiscard]] std::shared_ptr<Light> lightAt(int id) const;
 
  public:
   Scene();
@@ -25,6 +46,13 @@ class Scene {
    * @return returns the number of geometries in the scene
    */
   [[nodiscard]] int countGeometries() const;
+  /**
+   * @return the geometries added to the scene, e.g. to move their vertices
+   *         before refitAccel
+   */
+  [[nodiscard]] const std::vector<std::shared_ptr<Geometry>> &getGeometries() const {
+    return geometries;
+  }
   /**
    * sets a light source
    */
@@ -41,13 +69,73 @@ class Scene {
    * @return checks whether a ray intersectes with the scene
    */
   bool intersect(const Ray &ray, Interaction &interaction) const;
+  /**
+   * intersect a packet of coherent rays with the scene
+   * @param[in] packet the given rays
+   * @param[out] hits output intersect info and whether each ray hit the scene
+   */
+  void intersect(const RayPacket<RAY_PACKET_SIZE> &packet,
+                 HitPacket<RAY_PACKET_SIZE> &hits) const;
+  /**
+   * @param[in] ray the given ray
+   * @param[in] maxDist the end of the segment (in units of t)
+   * @return checks whether any geometry lies on the segment, lights do not
+   *         occlude and no intersect info is computed
+   */
+  [[nodiscard]] bool occluded(const Ray &ray, Float maxDist) const;
   /**
    * @param[in] ray the given ray
-   * @return checks whether a ray is shadowed in the scene
+   * @return checks whether the closest hit of the ray before ray.tMax is
+   *         geometry rather than a light, see occluded for shadow rays
    */
   [[nodiscard]] bool isShadowed(const Ray &ray) const;
 
-  void buildAccel();
+  /**
+   * build the acceleration structure over all geometries and the emissive
+   * triangles of the lights. Meshes, instances and built acceleration
+   * structures are taken, other geometries are skipped with a message.
+   * @param[in] type the kind of acceleration structure
+   * @param[in] method how the trees are built: SAH, SAH with spatial splits
+   *            (SBVH) for large or long thin triangles, or the Morton code
+   *            builder (LBVH) for fast rebuilds, e.g. previews and animation
+   * @param[in] statsPath if not empty, a JSON report of the built structures
+   *            (shape, SAH cost, memory, build phase times) is written there
+   */
+  void buildAccel(AccelType type = AccelType::KD_TREE,
+                  BuildMethod method = BuildMethod::SAH,
+                  const std::string &statsPath = "");
+  /**
+   * @return whether an acceleration structure was built or loaded
+   */
+  [[nodiscard]] bool isAccelBuilt() const { return hasAccel; }
+  /**
+   * update the acceleration structure after vertices of the meshes moved,
+   * k-d trees and their instances are refit and only rebuilt once their
+   * quality degraded too much, the wide BVHs are always rebuilt
+   */
+  void refitAccel();
+  /**
+   * write the built acceleration structure with its meshes to a snapshot,
+   * only k-d trees and instances of k-d trees can be stored
+   * @param[in] path the snapshot file
+   * @param[in] key hash of the scene inputs
+   * @param[in] materials every material used by the geometries
+   * @return whether the snapshot was written
+   */
+  bool saveSnapshot(const std::string &path, uint64_t key,
+                    const std::vector<std::shared_ptr<BRDF>> &materials) const;
+  /**
+   * load the acceleration structure from a snapshot instead of adding
+   * geometries and building it, the lights are not part of a snapshot
+   * @param[in] path the snapshot file
+   * @param[in] key hash of the scene inputs, a snapshot of other inputs is
+   *            rejected
+   * @param[in] materials the material table the snapshot was written with
+   * @return whether the snapshot was loaded, a damaged one or one whose light
+   *         ids name no light of the scene is rejected
+   */
+  bool loadSnapshot(const std::string &path, uint64_t key,
+                    const std::vector<std::shared_ptr<BRDF>> &materials);
 };
 
 #endif  // CS171_HW3_INCLUDE_SCENE_H_
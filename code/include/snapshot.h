@@ -0,0 +1,129 @@
+#ifndef CS171_HW4_INCLUDE_SNAPSHOT_H_
+#define CS171_HW4_INCLUDE_SNAPSHOT_H_
+#include <geometry.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+/* Bump whenever the layout of a snapshot or of the saved structures changes */
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr uint64_t HASH_SEED = 14695981039346656037ull;
+
+/**
+ * 64-bit FNV-1a hash
+ * @param[in] data, size the bytes to hash
+ * @param[in] seed the hash of everything before, to chain several inputs
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = HASH_SEED);
+/**
+ * hash the content of a file, a missing file only hashes its path
+ */
+uint64_t hashFile(const std::string &path, uint64_t seed = HASH_SEED);
+
+/**
+ * Writer of a prepared-scene snapshot
+ * A snapshot holds the meshes, the built acceleration structures and the
+ * material of every mesh as an index into a table the caller provides.
+ * Structures append their raw arrays to the body, the vertex data of every
+ * mesh is stored once in a section before the body, so that a reader has it
+ * at hand when it meets the first reference to the mesh.
+ */
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(const std::vector<std::shared_ptr<BRDF>> &materials);
+  template <typename T>
+  void write(const T &value) {
+    append(body, &value, sizeof(T));
+  }
+  template <typename T>
+  void writeArray(const std::vector<T> &values) {
+    write<uint64_t>(values.size());
+    append(body, values.data(), values.size() * sizeof(T));
+  }
+  /* Write a mesh geometry as its vertex data and its material */
+  void writeMesh(const Mesh &mesh);
+  /**
+   * shared objects are written once, later references only store the index
+   * @param[in] object the object to reference
+   * @param[out] index index of the object in the snapshot
+   * @return whether this is the first reference, the object must follow
+   */
+  bool addObject(const void *object, int &index);
+  /* Mark the snapshot as unusable, e.g. for an unsupported structure */
+  void fail() { good = false; }
+  /**
+   * write the snapshot to a file
+   * @param[in] path the file
+   * @param[in] key hash of the scene inputs, a reader with another key
+   *            rejects the file
+   * @return whether the file was written
+   */
+  bool finish(const std::string &path, uint64_t key);
+
+ private:
+  static void append(std::vector<char> &buffer, const void *data, size_t size);
+
+  const std::vector<std::shared_ptr<BRDF>> &materials;
+  std::unordered_map<const TriangleMesh *, int> meshIds;
+  std::unordered_map<const void *, int> objectIds;
+  std::vector<char> meshData;
+  std::vector<char> body;
+  bool good = true;
+};
+
+/**
+ * Reader of a snapshot written by SnapshotWriter
+ * The file is memory-mapped, arrays are copied out of the mapping with
+ * memcpy, nothing is parsed or rebuilt.
+ */
+class SnapshotReader {
+ public:
+  /**
+   * @param[in] path the snapshot file
+   * @param[in] key hash of the scene inputs, must match the written one
+   * @param[in] materials the same material table the snapshot was written with
+   */
+  explicit SnapshotReader(const std::string &path, uint64_t key,
+                          const std::vector<std::shared_ptr<BRDF>> &materials);
+  ~SnapshotReader();
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+  /* Whether the file is valid and every read so far stayed inside it */
+  [[nodiscard]] bool ok() const { return good; }
+  template <typename T>
+  T read() {
+    T value{};
+    take(&value, sizeof(T));
+    return value;
+  }
+  template <typename T>
+  void readArray(std::vector<T> &values) {
+    auto count = read<uint64_t>();
+    if (!good || count > (size - offset) / sizeof(T)) {
+      good = false;
+      return;
+    }
+    values.resize(count);
+    take(values.data(), count * sizeof(T));
+  }
+  /* Read a mesh geometry written by SnapshotWriter::writeMesh */
+  std::shared_ptr<Mesh> readMesh();
+
+  // shared objects read so far, see SnapshotWriter::addObject
+  std::vector<std::shared_ptr<Geometry>> objects;
+
+ private:
+  void take(void *out, size_t bytes);
+
+  const std::vector<std::shared_ptr<BRDF>> &materials;
+  std::vector<std::shared_ptr<TriangleMesh>> meshes;
+  const char *data = nullptr;
+  size_t size = 0;
+  size_t offset = 0;
+  std::vector<char> buffer;  // file content if it cannot be mapped
+  bool mapped = false;
+  bool good = false;
+};
+
+#endif  // CS171_HW4_INCLUDE_SNAPSHOT_H_
@@ -0,0 +1,52 @@
+#ifndef CS171_HW4_INCLUDE_TRAVERSAL_STATS_H_
+#define CS171_HW4_INCLUDE_TRAVERSAL_STATS_H_
+#include <core.h>
+#include <cstdint>
+
+/**
+ * Traversal cost counters, enabled with the ACCEL_TRAVERSAL_STATS CMake
+ * option. Without it every macro below expands to nothing.
+ */
+#ifdef ACCEL_TRAVERSAL_STATS
+/**
+ * Nodes visited and triangles tested by the rays traced last on this thread
+ * Packet traversals count every ray in its own lane, single ray traversals
+ * count into the current lane, so that a packet traced ray by ray is counted
+ * the same way.
+ */
+struct TraversalCounters {
+  int lane = 0;
+  int nodes[RAY_PACKET_SIZE] = {};
+  int triangles[RAY_PACKET_SIZE] = {};
+
+  void reset() {
+    lane = 0;
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) nodes[i] = triangles[i] = 0;
+  }
+};
+
+inline TraversalCounters &traversalCounters() {
+  static thread_local TraversalCounters counters;
+  return counters;
+}
+
+inline void countPacketNodes(uint32_t mask) {
+  for (int i = 0; mask; i++, mask >>= 1)
+    if (mask & 1) traversalCounters().nodes[i]++;
+}
+
+#define TRAVERSAL_COUNT_NODE() (traversalCounters().nodes[traversalCounters().lane]++)
+#define TRAVERSAL_COUNT_TRIANGLES(n) \
+  (traversalCounters().triangles[traversalCounters().lane] += (n))
+#define TRAVERSAL_COUNT_PACKET_NODE(mask) countPacketNodes(mask)
+#define TRAVERSAL_COUNT_PACKET_TRIANGLES(i, n) (traversalCounters().triangles[i] += (n))
+#define TRAVERSAL_SET_LANE(i) (traversalCounters().lane = (i))
+#else
+#define TRAVERSAL_COUNT_NODE() ((void)0)
+#define TRAVERSAL_COUNT_TRIANGLES(n) ((void)0)
+#define TRAVERSAL_COUNT_PACKET_NODE(mask) ((void)0)
+#define TRAVERSAL_COUNT_PACKET_TRIANGLES(i, n) ((void)0)
+#define TRAVERSAL_SET_LANE(i) ((void)0)
+#endif
+
+#endif  // CS171_HW4_INCLUDE_TRAVERSAL_STATS_H_
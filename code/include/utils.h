@@ -3,8 +3,14 @@
 #include <core.h>
 #include <random>
 
-inline std::vector<Float> unif(Float a, Float b, int N) {
+/* The engine unif draws from, seed it to repeat a single threaded render */
+inline std::default_random_engine &randomEngine() {
   static std::default_random_engine engine;
+  return engine;
+}
+
+inline std::vector<Float> unif(Float a, Float b, int N) {
+  std::default_random_engine &engine = randomEngine();
   std::vector<Float> res;
   std::uniform_real_distribution<Float> dis(a, b);
 
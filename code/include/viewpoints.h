@@ -13,6 +13,9 @@ public:
   vec3 color;
   double strength;
   int x, y;
+  vec3 flux{vec3::Zero()};  // photon contributions of the round, added to pixel (x, y) after the photon pass
+  Float radius2 = 0;        // squared gather radius of the pixel in progressive mode
+  Float photons = 0;        // photons gathered this round in progressive mode, weighted by strength
 
   ViewPoint() {}
   ViewPoint(vec3 pos, vec3 N, vec3 color, double stgh, int x, int y);
@@ -23,15 +26,15 @@ public:
 class KdPointTreeNode
 {
 public:
-  explicit KdPointTreeNode(std::vector<std::shared_ptr<ViewPoint>> viewpoints, AABB box, int depth);
+  explicit KdPointTreeNode(std::vector<const ViewPoint*> viewpoints, AABB box, int depth);
   ~KdPointTreeNode();
-  void search(std::vector<std::shared_ptr<ViewPoint>>& result, const vec3& pos, double r);
+  void search(std::vector<const ViewPoint*>& result, const vec3& pos, double r);
   [[nodiscard]] bool isLeaf() const { return !leftChild && !rightChild; }
 
 private:
   KdPointTreeNode* leftChild, * rightChild;
   AABB box;
-  std::vector<std::shared_ptr<ViewPoint>> viewpoints;
+  std::vector<const ViewPoint*> viewpoints;
 };
 
 
@@ -40,15 +43,54 @@ private:
 class KdPointTree
 {
 public:
-  /* Creat the tree using a series of viewpoints */
-  explicit KdPointTree(const std::vector<std::shared_ptr<ViewPoint>>& viewpoints);
+  /* Creat the tree using a series of viewpoints, which must outlive the tree */
+  explicit KdPointTree(const std::vector<ViewPoint>& viewpoints);
   /* Return the points at pos with radius r in result */
-  void search(std::vector<std::shared_ptr<ViewPoint>>& result, const vec3& pos, double r);
+  void search(std::vector<const ViewPoint*>& result, const vec3& pos, double r);
 
 private:
   std::unique_ptr<KdPointTreeNode> root{};
 };
 
+/**
+ * Uniform hash grid over view points
+ * The cells are twice as wide as the search radius, so the sphere of a
+ * search touches at most 2x2x2 cells. Cells are hashed into a table of about
+ * as many buckets as points, the points of a bucket are stored contiguously
+ * after a counting sort, so a search scans at most eight ranges of flat
+ * arrays and never recurses.
+ */
+class ViewPointGrid
+{
+public:
+  ViewPointGrid() = default;
+  /**
+   * @param[in] viewpoints the points to search
+   * @param[in] radius the largest radius a search may use, the grid is
+   *            empty if it is not positive
+   */
+  ViewPointGrid(const std::vector<ViewPoint>& viewpoints, Float radius);
+  /**
+   * find the points closer to pos than r
+   * @param[out] result indices of the points into the array the grid was built from
+   * @param[in] pos center of the search
+   * @param[in] r the radius, at most the one the grid was built with
+   */
+  void search(std::vector<int>& result, const vec3& pos, Float r) const;
+
+private:
+  /* Integer coordinates of the cell holding pos */
+  [[nodiscard]] Vector3<int> cellOf(const vec3& pos) const;
+  /* Bucket of the cell with integer coordinates cell */
+  [[nodiscard]] int bucket(const Vector3<int>& cell) const;
+
+  Float invCellSize = 0;
+  int mask = 0;                 // number of buckets - 1, a power of two
+  std::vector<int> cellStart;   // points of bucket b are [cellStart[b], cellStart[b + 1])
+  std::vector<int> indices;     // index of every point, sorted by bucket
+  std::vector<vec3> positions;  // position of every point in the same order
+};
+
 
 
 #endif
@@ -1,178 +1,1309 @@
 #include <accel.h>
 #include <ray.h>
 #include <geometry.h>
+#include <snapshot.h>
+#include <traversal_stats.h>
+#include <algorithm>
+#include <sstream>
+#define USE_OPENMP 1
 
-//functions to sort
-bool xcmp(const std::shared_ptr<Triangle>& t1, const std::shared_ptr<Triangle>& t2) { return t1.get()->getCenter().x() < t2.get()->getCenter().x(); } // compare along x-axis
-bool ycmp(const std::shared_ptr<Triangle>& t1, const std::shared_ptr<Triangle>& t2) { return t1.get()->getCenter().y() < t2.get()->getCenter().y(); } // compare along y-axis
-bool zcmp(const std::shared_ptr<Triangle>& t1, const std::shared_ptr<Triangle>& t2) { return t1.get()->getCenter().z() < t2.get()->getCenter().z(); } // compare along z-axis
+KdTreeBuilder::KdTreeBuilder(const std::vector<AABB>& bounds) : bounds(bounds) {}
 
+void KdTreeBuilder::enableSpatialSplits(const MeshPrimitives& primitives) {
+    this->primitives = &primitives;
+}
 
-/**
- * construct kd tree with given triangles
- * @param triangles a array of triangles
- */
-KdTreeNode::KdTreeNode(std::vector<std::shared_ptr<Triangle>> triangles,
-    AABB box, int depth) {
-    // the space of the current node
-    this->box = box;
-    // stop dividing when the number of triangles is small enough
-    // or stop when depth is too large
-    // 8 and 40 are just examples, it may not be good enough
-    if (triangles.size() < 8 || depth > 40) {
-        this->triangles = triangles;
-        this->leftChild = NULL;
-        this->rightChild = NULL;
-        // TODO: store triangles into the leaf node
+void KdTreeBuilder::build(std::vector<LinearKdTreeNode>& nodes,
+    std::vector<int>& primitiveIndices) {
+    int n = static_cast<int>(bounds.size());
+    prims.resize(n);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < n; i++) {
+        prims[i].box = bounds[i];
+        prims[i].center = bounds[i].getCenter();
+        prims[i].index = i;
+    }
+    nodes.clear();
+    // a binary tree over n primitives has fewer than 2n nodes
+    nodes.reserve(2 * static_cast<size_t>(n));
+    if (primitives != nullptr) {
+        // references are duplicated, the leaves collect them in build order
+        AABB box(vec3::Constant(INF), vec3::Constant(-INF));
+        for (auto& prim : prims) box = AABB(box, prim.box);
+        rootArea = box.surfaceArea();
+        int budget = static_cast<int>(n * SBVH_MAX_DUPLICATION);
+        primitiveIndices.clear();
+        primitiveIndices.reserve(static_cast<size_t>(n) + budget);
+        if (n > 0) {
+#ifdef USE_OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+            buildSpatialRecursive(std::move(prims), 0, budget, nodes, primitiveIndices);
+        }
+        nodes.shrink_to_fit();
+        primitiveIndices.shrink_to_fit();
+        prims.clear();
+        prims.shrink_to_fit();
+        return;
+    }
+    if (n > 0) {
+        // large subtrees are built as tasks, see buildRecursive
+#ifdef USE_OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+        buildRecursive(0, n, 0, nodes);
+    }
+    nodes.shrink_to_fit();
+    primitiveIndices.resize(n);
+    for (int i = 0; i < n; i++) primitiveIndices[i] = prims[i].index;
+    prims.clear();
+    prims.shrink_to_fit();
+}
+
+KdTreeBuilder::ObjectSplit KdTreeBuilder::findObjectSplit(const BuildPrimitive* refs, int n,
+    const AABB& centerBox) {
+    struct Bin {
+        AABB box;
+        int count;
+    };
+    // bin the centers along all three axes in a single pass, small nodes
+    // use fewer bins since they cannot fill more than n of them
+    int nBins = std::min(SAH_BIN_NUM, n);
+    Bin bins[3][SAH_BIN_NUM];
+    Float scale[3];
+    for (int a = 0; a < 3; a++) {
+        Float extent = centerBox.getDist(a);
+        scale[a] = extent > 0 ? nBins / extent : 0;
+        for (int b = 0; b < nBins; b++) {
+            bins[a][b].box = AABB(vec3::Constant(INF), vec3::Constant(-INF));
+            bins[a][b].count = 0;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        const BuildPrimitive& prim = refs[i];
+        for (int a = 0; a < 3; a++) {
+            int b = std::min(nBins - 1,
+                static_cast<int>((prim.center[a] - centerBox.lb[a]) * scale[a]));
+            bins[a][b].count++;
+            bins[a][b].box = AABB(bins[a][b].box, prim.box);
+        }
+    }
+
+    ObjectSplit best;
+    best.nBins = nBins;
+    for (int a = 0; a < 3; a++) {
+        if (scale[a] == 0) continue;  // all centers lie on a plane, cannot split along a
+        // sweep from the right to get the cost of everything above each split
+        Float rightCost[SAH_BIN_NUM];
+        AABB rightBoxes[SAH_BIN_NUM];
+        AABB rightBox = bins[a][nBins - 1].box;
+        int rightCount = bins[a][nBins - 1].count;
+        for (int b = nBins - 1; b > 0; b--) {
+            if (b < nBins - 1) {
+                rightBox = AABB(rightBox, bins[a][b].box);
+                rightCount += bins[a][b].count;
+            }
+            rightCost[b] = rightCount > 0 ? rightBox.surfaceArea() * rightCount : INF;
+            rightBoxes[b] = rightBox;
+        }
+        AABB leftBox = bins[a][0].box;
+        int leftCount = 0;
+        for (int b = 0; b < nBins - 1; b++) {
+            if (b > 0) leftBox = AABB(leftBox, bins[a][b].box);
+            leftCount += bins[a][b].count;
+            if (leftCount == 0 || leftCount == n) continue;
+            Float cost = leftBox.surfaceArea() * leftCount + rightCost[b + 1];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = a;
+                best.bin = b;
+                best.leftBox = leftBox;
+                best.rightBox = rightBoxes[b + 1];
+            }
+        }
+    }
+    return best;
+}
+
+int KdTreeBuilder::partitionObjects(BuildPrimitive* refs, int n, const AABB& centerBox,
+    const ObjectSplit& split) {
+    Float lb = centerBox.lb[split.axis];
+    Float s = split.nBins / centerBox.getDist(split.axis);
+    auto midIter = std::partition(refs, refs + n, [&](const BuildPrimitive& prim) {
+        int b = std::min(split.nBins - 1, static_cast<int>((prim.center[split.axis] - lb) * s));
+        return b <= split.bin;
+    });
+    return static_cast<int>(midIter - refs);
+}
+
+bool KdTreeBuilder::leafIsCheaper(Float cost, int n, const AABB& box) {
+    Float splitCost = SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * cost / box.surfaceArea();
+    return splitCost >= SAH_INTERSECT_COST * n && n <= KD_MAX_LEAF_SIZE;
+}
+
+bool KdTreeBuilder::findSplit(int start, int end, const AABB& box,
+    const AABB& centerBox, int& axis, int& mid) {
+    int n = end - start;
+    ObjectSplit split = findObjectSplit(prims.data() + start, n, centerBox);
+    if (split.axis == -1) {
+        // every center coincides, split in the middle if the leaf is too large
+        if (n <= KD_MAX_LEAF_SIZE) return false;
+        axis = 0;
+        mid = start + n / 2;
+        return true;
+    }
+    if (leafIsCheaper(split.cost, n, box)) return false;
+    axis = split.axis;
+    mid = start + partitionObjects(prims.data() + start, n, centerBox, split);
+    return true;
+}
+
+void KdTreeBuilder::buildRecursive(int start, int end, int depth,
+    std::vector<LinearKdTreeNode>& nodes) {
+    AABB box(vec3::Constant(INF), vec3::Constant(-INF));
+    AABB centerBox = box;
+    for (int i = start; i < end; i++) {
+        box = AABB(box, prims[i].box);
+        centerBox = AABB(centerBox, prims[i].center);
+    }
+
+    int offset = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    nodes[offset].box = box;
+
+    int axis = 0, mid = start;
+    if (end - start == 1 || depth >= KD_MAX_DEPTH || !findSplit(start, end, box, centerBox, axis, mid)) {
+        assert(end - start <= UINT16_MAX);
+        nodes[offset].primitivesOffset = start;
+        nodes[offset].nPrimitives = static_cast<uint16_t>(end - start);
+        nodes[offset].axis = 0;
+        return;
+    }
+    nodes[offset].nPrimitives = 0;
+    nodes[offset].axis = static_cast<uint8_t>(axis);
+    if (end - start < KD_PARALLEL_BUILD_SIZE) {
+        buildRecursive(start, mid, depth + 1, nodes);
+        nodes[offset].secondChildOffset = static_cast<int>(nodes.size());
+        buildRecursive(mid, end, depth + 1, nodes);
+        return;
+    }
+
+    // build the second child concurrently into its own array, then append it
+    // behind the first child. The layout is the same as the serial one, so the
+    // result does not depend on the number of threads.
+    std::vector<LinearKdTreeNode> rightNodes;
+#ifdef USE_OPENMP
+#pragma omp task shared(rightNodes) firstprivate(mid, end, depth)
+#endif
+    buildRecursive(mid, end, depth + 1, rightNodes);
+    buildRecursive(start, mid, depth + 1, nodes);
+#ifdef USE_OPENMP
+#pragma omp taskwait
+#endif
+    int base = static_cast<int>(nodes.size());
+    for (auto& node : rightNodes) {
+        if (node.nPrimitives == 0) node.secondChildOffset += base;
+        nodes.push_back(node);
+    }
+    nodes[offset].secondChildOffset = base;
+}
+
+AABB KdTreeBuilder::clipReference(const BuildPrimitive& ref, int axis, Float lo, Float hi) const {
+    // the triangle vertices and edge crossings inside the slab
+    AABB clipped(vec3::Constant(INF), vec3::Constant(-INF));
+    for (int i = 0; i < 3; i++) {
+        const vec3& v0 = primitives->getVertex(ref.index, i);
+        const vec3& v1 = primitives->getVertex(ref.index, (i + 1) % 3);
+        if (v0[axis] >= lo && v0[axis] <= hi) clipped = AABB(clipped, v0);
+        for (Float plane : {lo, hi}) {
+            if ((v0[axis] < plane && v1[axis] > plane) || (v0[axis] > plane && v1[axis] < plane)) {
+                vec3 p = v0 + (plane - v0[axis]) / (v1[axis] - v0[axis]) * (v1 - v0);
+                p[axis] = plane;
+                clipped = AABB(clipped, p);
+            }
+        }
+    }
+    // a reference may already be a clipped part of its triangle
+    clipped.lb = clipped.lb.cwiseMax(ref.box.lb);
+    clipped.ub = clipped.ub.cwiseMin(ref.box.ub);
+    return clipped;
+}
+
+KdTreeBuilder::SpatialSplit KdTreeBuilder::findSpatialSplit(
+    const std::vector<BuildPrimitive>& refs, const AABB& box) const {
+    struct Bin {
+        AABB box;
+        int entries;  // references starting in the bin
+        int exits;    // references ending in the bin
+    };
+    SpatialSplit best;
+    for (int a = 0; a < 3; a++) {
+        Float extent = box.getDist(a);
+        if (extent <= 0) continue;
+        Float width = extent / SAH_BIN_NUM;
+        Bin bins[SAH_BIN_NUM];
+        for (auto& bin : bins) {
+            bin.box = AABB(vec3::Constant(INF), vec3::Constant(-INF));
+            bin.entries = bin.exits = 0;
+        }
+        auto binOf = [&](Float x) {
+            return std::clamp(static_cast<int>((x - box.lb[a]) / width), 0, SAH_BIN_NUM - 1);
+        };
+        for (const auto& ref : refs) {
+            int first = binOf(ref.box.lb[a]), last = binOf(ref.box.ub[a]);
+            if (first == last) {
+                bins[first].box = AABB(bins[first].box, ref.box);
+            } else {
+                // chop the reference into the bins it crosses
+                for (int b = first; b <= last; b++) {
+                    AABB part = clipReference(ref, a, box.lb[a] + b * width,
+                        b == last ? box.ub[a] : box.lb[a] + (b + 1) * width);
+                    bins[b].box = AABB(bins[b].box, part);
+                }
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+        Float rightCost[SAH_BIN_NUM];
+        AABB rightBox = bins[SAH_BIN_NUM - 1].box;
+        int rightCount = bins[SAH_BIN_NUM - 1].exits;
+        for (int b = SAH_BIN_NUM - 1; b > 0; b--) {
+            if (b < SAH_BIN_NUM - 1) {
+                rightBox = AABB(rightBox, bins[b].box);
+                rightCount += bins[b].exits;
+            }
+            rightCost[b] = rightCount > 0 ? rightBox.surfaceArea() * rightCount : INF;
+        }
+        AABB leftBox = bins[0].box;
+        int leftCount = 0;
+        for (int b = 0; b < SAH_BIN_NUM - 1; b++) {
+            if (b > 0) leftBox = AABB(leftBox, bins[b].box);
+            leftCount += bins[b].entries;
+            if (leftCount == 0) continue;
+            Float cost = leftBox.surfaceArea() * leftCount + rightCost[b + 1];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = a;
+                best.position = box.lb[a] + (b + 1) * width;
+            }
+        }
+    }
+    return best;
+}
+
+void KdTreeBuilder::buildSpatialRecursive(std::vector<BuildPrimitive> refs, int depth, int budget,
+    std::vector<LinearKdTreeNode>& nodes, std::vector<int>& indices) {
+    int n = static_cast<int>(refs.size());
+    AABB box(vec3::Constant(INF), vec3::Constant(-INF));
+    AABB centerBox = box;
+    for (auto& ref : refs) {
+        box = AABB(box, ref.box);
+        centerBox = AABB(centerBox, ref.center);
+    }
+
+    int offset = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    nodes[offset].box = box;
+    auto makeLeaf = [&]() {
+        assert(n <= UINT16_MAX);
+        nodes[offset].primitivesOffset = static_cast<int>(indices.size());
+        nodes[offset].nPrimitives = static_cast<uint16_t>(n);
+        nodes[offset].axis = 0;
+        for (auto& ref : refs) indices.push_back(ref.index);
+    };
+    if (n == 1 || depth >= KD_MAX_DEPTH) {
+        makeLeaf();
         return;
     }
 
+    ObjectSplit object = findObjectSplit(refs.data(), n, centerBox);
+    SpatialSplit spatial;
+    // spatial splits only pay off where the object split children overlap
+    if (object.axis != -1 && budget > 0) {
+        AABB overlap(object.leftBox.lb.cwiseMax(object.rightBox.lb),
+                     object.leftBox.ub.cwiseMin(object.rightBox.ub));
+        bool overlaps = (overlap.lb.array() <= overlap.ub.array()).all();
+        if (overlaps && overlap.surfaceArea() > SBVH_OVERLAP_THRESHOLD * rootArea)
+            spatial = findSpatialSplit(refs, box);
+    }
 
-    // TODO: divide the space into two parts according to one specific dimension
-    AABB leftSpace;
-    AABB rightSpace;
-
-
-    // TODO: put the corresponding overlapping triangles
-    std::vector<std::shared_ptr<Triangle>> leftTriangles;
-    std::vector<std::shared_ptr<Triangle>> rightTriangles;
-
-    Float overall_minCost = INF; // the minimun cost along all axis
-    int overall_best_split; // the best split along all axis
-    int best_axis; // the axis that gives the best division
-    for (int axis = 0; axis < 3; axis++)
-    {
-        if (axis == 0) std::sort(triangles.begin(), triangles.end(), xcmp);
-        if (axis == 1) std::sort(triangles.begin(), triangles.end(), ycmp);
-        if (axis == 2) std::sort(triangles.begin(), triangles.end(), zcmp);
-
-        //construct leftSpace and rightSpace
-        std::vector<AABB> leftspaces;
-        std::vector<AABB> rightspaces;
-        leftspaces.resize(triangles.size());
-        rightspaces.resize(triangles.size());
-        for (int i = 0; i < triangles.size(); i++)
-        {
-            auto left_triangle = triangles[i];
-            if (i == 0)
-            {
-                leftspaces[i] = AABB(left_triangle.get()->getVertex(0), left_triangle.get()->getVertex(1), left_triangle.get()->getVertex(2));
-            }
-            else
-            {
-                AABB tmp_left(left_triangle.get()->getVertex(0), left_triangle.get()->getVertex(1), left_triangle.get()->getVertex(2));
-                leftspaces[i] = AABB(leftspaces[i - 1], tmp_left);
-            }
-
-
-            auto right_triangle = triangles[triangles.size() - 1 - i];
-            if (i == 0)
-            {
-                rightspaces[triangles.size() - 1 - i] = AABB(right_triangle.get()->getVertex(0), right_triangle.get()->getVertex(1), right_triangle.get()->getVertex(2));
-            }
-            else
-            {
-                AABB tmp_right(right_triangle.get()->getVertex(0), right_triangle.get()->getVertex(1), right_triangle.get()->getVertex(2));
-                rightspaces[triangles.size() - 1 - i] = AABB(rightspaces[triangles.size() - i], tmp_right);
-            }
-        }
-
-        //compute the cost for each space division and choose the best division
-        Float minCost = INF;
-        int best_split = -1;
-        for (int i = 0; i < triangles.size(); i++)
-        {
-            Float cost = leftspaces[i].computeCost(i + 1) + rightspaces[i].computeCost(triangles.size() - 1 - i);
-            if (cost < minCost)
-            {
-                minCost = cost;
-                best_split = i;
-            }
-        }
-        if (minCost < overall_minCost)
-        {
-            overall_minCost = minCost;
-            best_axis = axis;
-            overall_best_split = best_split;
-            leftSpace = leftspaces[overall_best_split]; // we get the final leftSpace now
-            rightSpace = rightspaces[overall_best_split]; // we get the final rightSpace now
-            leftTriangles.assign(triangles.begin(), triangles.begin() + overall_best_split + 1);
-            rightTriangles.assign(triangles.begin() + overall_best_split + 1, triangles.end());
-        }
-    }
-
-
-    // recursively build left and right
-    leftChild = new KdTreeNode(leftTriangles, leftSpace, depth + 1);
-    rightChild = new KdTreeNode(rightTriangles, rightSpace, depth + 1);
-}
-
-bool KdTreeNode::intersect(Interaction& interaction, const Ray& ray) const {
-    // TODO: first check whether ray hit the bounding box
-    Float tIn, tOut;
-    if (!this->box.rayIntersection(ray, tIn, tOut)) return false; // not intersect with bounding box, return false directly.
-    if (isLeaf()) {
-        Interaction final_interaction;
-        bool intersect = false;
-        final_interaction.entryDist = INF;
-        for (auto triangle : triangles)
-        {
-            if (triangle.get()->intersect(interaction, ray))
-            {
-                intersect = true;
-                if (interaction.entryDist < final_interaction.entryDist) // it is the nearest triangle in the bounding box
-                {
-                    final_interaction = interaction;
+    std::vector<BuildPrimitive> left, right;
+    int axis = 0;
+    if (spatial.cost < object.cost && !leafIsCheaper(spatial.cost, n, box)) {
+        for (auto& ref : refs) {
+            if (ref.box.ub[spatial.axis] <= spatial.position) {
+                left.push_back(ref);
+            } else if (ref.box.lb[spatial.axis] >= spatial.position) {
+                right.push_back(ref);
+            } else {
+                // the reference is split, each side gets the box of its part
+                for (int side = 0; side < 2; side++) {
+                    BuildPrimitive part = ref;
+                    part.box = side == 0 ? clipReference(ref, spatial.axis, -INF, spatial.position)
+                                         : clipReference(ref, spatial.axis, spatial.position, INF);
+                    if (!(part.box.lb.array() <= part.box.ub.array()).all()) continue;
+                    part.center = part.box.getCenter();
+                    (side == 0 ? left : right).push_back(part);
                 }
             }
         }
-        interaction = final_interaction;
-        return intersect;
-        // all triangles are stored in leaf nodes
-        // TODO: do intersect with triangles
-    }
-    // TODO: recursively test intersection with left and right
-    bool left_result = leftChild->intersect(interaction, ray);
-    Interaction tmp_left_interaction = interaction;
-    bool right_result = rightChild->intersect(interaction, ray);
-    Interaction tmp_right_interaction = interaction;
-    if (left_result && right_result)
-    {
-        if (tmp_left_interaction.entryDist < tmp_right_interaction.entryDist && left_result)
-            interaction = tmp_left_interaction;
+        int extra = static_cast<int>(left.size() + right.size()) - n;
+        if (left.empty() || right.empty() || extra > budget) {
+            left.clear();
+            right.clear();
+        } else {
+            axis = spatial.axis;
+            budget -= extra;
+        }
+    }
+    if (left.empty()) {
+        int mid;
+        if (object.axis == -1) {
+            // every center coincides, split in the middle if the leaf is too large
+            if (n <= KD_MAX_LEAF_SIZE) {
+                makeLeaf();
+                return;
+            }
+            mid = n / 2;
+        } else {
+            if (leafIsCheaper(object.cost, n, box)) {
+                makeLeaf();
+                return;
+            }
+            mid = partitionObjects(refs.data(), n, centerBox, object);
+            axis = object.axis;
+        }
+        left.assign(refs.begin(), refs.begin() + mid);
+        right.assign(refs.begin() + mid, refs.end());
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+    // the children share what is left of the budget by their sizes
+    int leftBudget = static_cast<int>(int64_t(budget) * left.size() / (left.size() + right.size()));
+    int rightBudget = budget - leftBudget;
+
+    nodes[offset].nPrimitives = 0;
+    nodes[offset].axis = static_cast<uint8_t>(axis);
+    if (n < KD_PARALLEL_BUILD_SIZE) {
+        buildSpatialRecursive(std::move(left), depth + 1, leftBudget, nodes, indices);
+        nodes[offset].secondChildOffset = static_cast<int>(nodes.size());
+        buildSpatialRecursive(std::move(right), depth + 1, rightBudget, nodes, indices);
+        return;
+    }
+
+    // same as buildRecursive, the leaves of the second child also collect
+    // their indices into a separate array
+    std::vector<LinearKdTreeNode> rightNodes;
+    std::vector<int> rightIndices;
+#ifdef USE_OPENMP
+#pragma omp task shared(rightNodes, rightIndices, right) firstprivate(depth, rightBudget)
+#endif
+    buildSpatialRecursive(std::move(right), depth + 1, rightBudget, rightNodes, rightIndices);
+    buildSpatialRecursive(std::move(left), depth + 1, leftBudget, nodes, indices);
+#ifdef USE_OPENMP
+#pragma omp taskwait
+#endif
+    int base = static_cast<int>(nodes.size());
+    int indexBase = static_cast<int>(indices.size());
+    for (auto& node : rightNodes) {
+        if (node.nPrimitives == 0)
+            node.secondChildOffset += base;
+        else
+            node.primitivesOffset += indexBase;
+        nodes.push_back(node);
+    }
+    indices.insert(indices.end(), rightIndices.begin(), rightIndices.end());
+    nodes[offset].secondChildOffset = base;
+}
+
+namespace {
+
+/* Insert two zero bits before each of the lower 21 bits */
+uint64_t spreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+/**
+ * stable LSD radix sort of keys with values attached, 8 bits per pass. The
+ * arrays are cut into chunks that count and scatter their digits in
+ * parallel, the offsets of a digit are ordered by chunk to keep it stable.
+ * @param[in] bits only the lower bits of the keys are sorted by
+ */
+void radixSort(std::vector<uint64_t>& keys, std::vector<int>& values, int bits) {
+    constexpr int RADIX_BITS = 8;
+    constexpr int BUCKETS = 1 << RADIX_BITS;
+    int n = static_cast<int>(keys.size());
+    int nChunks = (n + KD_PARALLEL_BUILD_SIZE - 1) / KD_PARALLEL_BUILD_SIZE;
+    std::vector<uint64_t> keysOut(n);
+    std::vector<int> valuesOut(n);
+    std::vector<int> offsets(static_cast<size_t>(nChunks) * BUCKETS);
+    for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int c = 0; c < nChunks; c++) {
+            int* count = offsets.data() + static_cast<size_t>(c) * BUCKETS;
+            std::fill(count, count + BUCKETS, 0);
+            int end = std::min(n, (c + 1) * KD_PARALLEL_BUILD_SIZE);
+            for (int i = c * KD_PARALLEL_BUILD_SIZE; i < end; i++)
+                count[(keys[i] >> shift) & (BUCKETS - 1)]++;
+        }
+        int sum = 0;
+        for (int d = 0; d < BUCKETS; d++) {
+            for (int c = 0; c < nChunks; c++) {
+                int& offset = offsets[static_cast<size_t>(c) * BUCKETS + d];
+                int count = offset;
+                offset = sum;
+                sum += count;
+            }
+        }
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int c = 0; c < nChunks; c++) {
+            int* offset = offsets.data() + static_cast<size_t>(c) * BUCKETS;
+            int end = std::min(n, (c + 1) * KD_PARALLEL_BUILD_SIZE);
+            for (int i = c * KD_PARALLEL_BUILD_SIZE; i < end; i++) {
+                int j = offset[(keys[i] >> shift) & (BUCKETS - 1)]++;
+                keysOut[j] = keys[i];
+                valuesOut[j] = values[i];
+            }
+        }
+        keys.swap(keysOut);
+        values.swap(valuesOut);
+    }
+}
+
+}  // namespace
+
+void KdTreeBuilder::buildMorton(std::vector<LinearKdTreeNode>& nodes,
+    std::vector<int>& primitiveIndices) {
+    int n = static_cast<int>(bounds.size());
+    nodes.clear();
+    primitiveIndices.clear();
+    if (n == 0) return;
+    // box of the centers, reduced per chunk
+    int nChunks = (n + KD_PARALLEL_BUILD_SIZE - 1) / KD_PARALLEL_BUILD_SIZE;
+    std::vector<AABB> chunkBoxes(nChunks);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int c = 0; c < nChunks; c++) {
+        AABB box(vec3::Constant(INF), vec3::Constant(-INF));
+        int end = std::min(n, (c + 1) * KD_PARALLEL_BUILD_SIZE);
+        for (int i = c * KD_PARALLEL_BUILD_SIZE; i < end; i++) box = AABB(box, bounds[i].getCenter());
+        chunkBoxes[c] = box;
+    }
+    AABB centerBox = chunkBoxes[0];
+    for (int c = 1; c < nChunks; c++) centerBox = AABB(centerBox, chunkBoxes[c]);
+
+    // quantize the centers to a grid and interleave the bits of the cells
+    int bitsPerAxis = n > LBVH_LONG_CODE_SIZE ? 21 : 10;
+    Float cells = static_cast<Float>((1 << bitsPerAxis) - 1);
+    Float scale[3];
+    for (int a = 0; a < 3; a++) {
+        Float extent = centerBox.getDist(a);
+        scale[a] = extent > 0 ? cells / extent : 0;
+    }
+    std::vector<uint64_t> codes(n);
+    std::vector<int> order(n);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < n; i++) {
+        vec3 center = bounds[i].getCenter();
+        uint64_t code = 0;
+        for (int a = 0; a < 3; a++) {
+            Float cell = std::min(cells, std::max(Float(0), (center[a] - centerBox.lb[a]) * scale[a]));
+            code |= spreadBits(static_cast<uint64_t>(cell)) << (2 - a);
+        }
+        codes[i] = code;
+        order[i] = i;
+    }
+    radixSort(codes, order, 3 * bitsPerAxis);
+
+    nodes.reserve(2 * static_cast<size_t>(n));
+    // large subtrees are built as tasks, see buildRecursive
+#ifdef USE_OPENMP
+#pragma omp parallel
+#pragma omp single
+#endif
+    buildMortonRecursive(codes, order, 0, n, 0, nodes);
+    refitInteriorNodes(nodes);
+    nodes.shrink_to_fit();
+    primitiveIndices = std::move(order);
+}
+
+void KdTreeBuilder::buildMortonRecursive(const std::vector<uint64_t>& codes,
+    const std::vector<int>& order, int start, int end, int depth,
+    std::vector<LinearKdTreeNode>& nodes) const {
+    int offset = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    int n = end - start;
+    int axis = 0, mid = -1;
+    if (n > LBVH_LEAF_SIZE && depth < KD_MAX_DEPTH) {
+        uint64_t diff = codes[start] ^ codes[end - 1];
+        if (diff != 0) {
+            // the codes share every bit above the highest differing one, the
+            // primitives with that bit set form the second child
+            int bit = 63;
+            while (!((diff >> bit) & 1)) bit--;
+            uint64_t mask = uint64_t(1) << bit;
+            mid = static_cast<int>(std::partition_point(codes.begin() + start, codes.begin() + end,
+                [mask](uint64_t code) { return !(code & mask); }) - codes.begin());
+            axis = 2 - bit % 3;
+        }
+        else if (n > KD_MAX_LEAF_SIZE) {
+            // every center falls into the same cell
+            mid = start + n / 2;
+        }
+    }
+    if (mid < 0) {
+        assert(n <= UINT16_MAX);
+        AABB box = bounds[order[start]];
+        for (int i = start + 1; i < end; i++) box = AABB(box, bounds[order[i]]);
+        nodes[offset].box = box;
+        nodes[offset].primitivesOffset = start;
+        nodes[offset].nPrimitives = static_cast<uint16_t>(n);
+        nodes[offset].axis = 0;
+        return;
+    }
+    // interior boxes are filled in by refitInteriorNodes once the tree is done
+    nodes[offset].nPrimitives = 0;
+    nodes[offset].axis = static_cast<uint8_t>(axis);
+    if (n < KD_PARALLEL_BUILD_SIZE) {
+        buildMortonRecursive(codes, order, start, mid, depth + 1, nodes);
+        nodes[offset].secondChildOffset = static_cast<int>(nodes.size());
+        buildMortonRecursive(codes, order, mid, end, depth + 1, nodes);
+        return;
+    }
+
+    std::vector<LinearKdTreeNode> rightNodes;
+#ifdef USE_OPENMP
+#pragma omp task shared(codes, order, rightNodes) firstprivate(mid, end, depth)
+#endif
+    buildMortonRecursive(codes, order, mid, end, depth + 1, rightNodes);
+    buildMortonRecursive(codes, order, start, mid, depth + 1, nodes);
+#ifdef USE_OPENMP
+#pragma omp taskwait
+#endif
+    int base = static_cast<int>(nodes.size());
+    for (auto& node : rightNodes) {
+        if (node.nPrimitives == 0) node.secondChildOffset += base;
+        nodes.push_back(node);
+    }
+    nodes[offset].secondChildOffset = base;
+}
+
+void buildTree(const std::vector<AABB>& bounds, const MeshPrimitives& primitives,
+    BuildMethod method, std::vector<LinearKdTreeNode>& nodes,
+    std::vector<int>& primitiveIndices) {
+    KdTreeBuilder builder(bounds);
+    switch (method) {
+    case BuildMethod::LBVH:
+        builder.buildMorton(nodes, primitiveIndices);
+        return;
+    case BuildMethod::SBVH:
+        builder.enableSpatialSplits(primitives);
+        break;
+    default:
+        break;
+    }
+    builder.build(nodes, primitiveIndices);
+}
+
+std::string buildMethodSuffix(BuildMethod method) {
+    switch (method) {
+    case BuildMethod::SBVH:
+        return "-sbvh";
+    case BuildMethod::LBVH:
+        return "-lbvh";
+    default:
+        return "";
+    }
+}
+
+namespace {
+
+/* Store the precomputed vertex and edges of a triangle in a block lane */
+void setBlockLane(TriangleBlock& block, int lane, const MeshPrimitives& primitives, int prim) {
+    const vec3& v0 = primitives.getVertex(prim, 0);
+    const vec3& v1 = primitives.getVertex(prim, 1);
+    const vec3& v2 = primitives.getVertex(prim, 2);
+    for (int a = 0; a < 3; a++) {
+        block.v0[a][lane] = v0[a];
+        block.e1[a][lane] = v1[a] - v0[a];
+        block.e2[a][lane] = v2[a] - v0[a];
+    }
+}
+
+}  // namespace
+
+void refitInteriorNodes(std::vector<LinearKdTreeNode>& nodes) {
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+        LinearKdTreeNode& node = nodes[i];
+        if (node.nPrimitives == 0)
+            node.box = AABB(nodes[i + 1].box, nodes[node.secondChildOffset].box);
+    }
+}
+
+Float computeSahCost(const std::vector<LinearKdTreeNode>& nodes) {
+    if (nodes.empty()) return 0;
+    Float rootArea = nodes[0].box.surfaceArea();
+    if (rootArea <= 0) return 0;
+    Float cost = 0;
+    for (const auto& node : nodes) {
+        if (node.nPrimitives == 0)
+            cost += SAH_TRAVERSAL_COST * node.box.surfaceArea();
         else
-            interaction = tmp_right_interaction;
+            cost += SAH_INTERSECT_COST * node.nPrimitives * node.box.surfaceArea();
+    }
+    return cost / rootArea;
+}
+
+void AccelStats::addLeaf(int size, int depth) {
+    leaves++;
+    references += size;
+    maxDepth = std::max(maxDepth, depth);
+    averageDepth += (depth - averageDepth) / leaves;
+    if (size >= static_cast<int>(leafSizeHistogram.size())) leafSizeHistogram.resize(size + 1, 0);
+    leafSizeHistogram[size]++;
+}
+
+void AccelStats::addPhase(const std::string& name,
+    std::chrono::high_resolution_clock::time_point& start) {
+    auto now = std::chrono::high_resolution_clock::now();
+    phaseTimes.emplace_back(name, std::chrono::duration<double, std::milli>(now - start).count());
+    start = now;
+}
+
+std::string AccelStats::toJson(const std::string& indent) const {
+    std::ostringstream out;
+    std::string inner = indent + "  ";
+    out << "{\n";
+    out << inner << "\"type\": \"" << type << "\",\n";
+    out << inner << "\"primitives\": " << primitives << ",\n";
+    out << inner << "\"references\": " << references << ",\n";
+    out << inner << "\"nodes\": " << nodes << ",\n";
+    out << inner << "\"leaves\": " << leaves << ",\n";
+    out << inner << "\"maxDepth\": " << maxDepth << ",\n";
+    out << inner << "\"averageDepth\": " << averageDepth << ",\n";
+    out << inner << "\"sahCost\": " << sahCost << ",\n";
+    out << inner << "\"memoryBytes\": " << memoryBytes << ",\n";
+    out << inner << "\"bytesPerPrimitive\": "
+        << (primitives > 0 ? static_cast<double>(memoryBytes) / primitives : 0.0) << ",\n";
+    out << inner << "\"leafSizeHistogram\": [";
+    for (size_t i = 0; i < leafSizeHistogram.size(); i++)
+        out << (i > 0 ? ", " : "") << leafSizeHistogram[i];
+    out << "],\n";
+    out << inner << "\"phaseMs\": {";
+    double total = 0;
+    for (size_t i = 0; i < phaseTimes.size(); i++) {
+        out << (i > 0 ? ", " : "") << "\"" << phaseTimes[i].first << "\": " << phaseTimes[i].second;
+        total += phaseTimes[i].second;
+    }
+    out << "},\n";
+    out << inner << "\"buildMs\": " << total << "\n";
+    out << indent << "}";
+    return out.str();
+}
+
+AccelStats computeTreeStats(const std::vector<LinearKdTreeNode>& nodes) {
+    AccelStats stats;
+    stats.nodes = static_cast<int>(nodes.size());
+    // children follow their parent, so depths are known before they are used
+    std::vector<int> depth(nodes.size(), 0);
+    for (int i = 0; i < static_cast<int>(nodes.size()); i++) {
+        const LinearKdTreeNode& node = nodes[i];
+        if (node.nPrimitives == 0) {
+            depth[i + 1] = depth[node.secondChildOffset] = depth[i] + 1;
+        } else {
+            stats.addLeaf(node.nPrimitives, depth[i]);
+        }
+    }
+    stats.sahCost = computeSahCost(nodes);
+    return stats;
+}
+
+bool isValidTree(const std::vector<LinearKdTreeNode>& nodes, size_t entries,
+    int primitivesPerEntry) {
+    int n = static_cast<int>(nodes.size());
+    // children follow their parent, one forward sweep sees every reference
+    // to a node and its depth before the node itself
+    std::vector<int> parents(nodes.size(), 0);
+    std::vector<int> depth(nodes.size(), 0);
+    for (int i = 0; i < n; i++) {
+        const LinearKdTreeNode& node = nodes[i];
+        if ((i > 0 && parents[i] != 1) || depth[i] > KD_MAX_DEPTH) return false;
+        if (node.nPrimitives > 0) {
+            size_t used = (node.nPrimitives + primitivesPerEntry - 1) / primitivesPerEntry;
+            if (node.primitivesOffset < 0 || static_cast<size_t>(node.primitivesOffset) + used > entries)
+                return false;
+            continue;
+        }
+        int second = node.secondChildOffset;
+        if (node.axis > 2 || second <= i + 1 || second >= n) return false;
+        parents[i + 1]++;
+        parents[second]++;
+        depth[i + 1] = depth[second] = depth[i] + 1;
+    }
+    return true;
+}
+
+MeshPrimitives::MeshPrimitives(std::vector<std::shared_ptr<Mesh>> meshes,
+    std::vector<int> lightIds)
+    : meshes(std::move(meshes)), lightIds(std::move(lightIds)) {
+    size_t n = 0;
+    for (auto& mesh : this->meshes) n += mesh->countTriangles();
+    refs.reserve(n);
+    for (int m = 0; m < static_cast<int>(this->meshes.size()); m++) {
+        for (int i = 0; i < this->meshes[m]->countTriangles(); i++) refs.push_back({ m, i });
+    }
+}
+
+void MeshPrimitives::resolve(Interaction& interaction, const HitRecord& hit,
+    const Ray& ray) const {
+    const Ref& ref = refs[hit.primId];
+    meshes[ref.mesh]->computeInteraction(interaction, ray, ref.triangle, hit.t, hit.u, hit.v);
+    interaction.lightId = lightIds.empty() ? -1 : lightIds[ref.mesh];
+    if (interaction.lightId >= 0) interaction.type = Interaction::Type::LIGHT;
+}
+
+KdTreeAccel::KdTreeAccel(MeshPrimitives primitives, BuildMethod method)
+    : primitives(std::move(primitives)), method(method) {
+    build();
+}
+
+void KdTreeAccel::build() {
+    auto start = std::chrono::high_resolution_clock::now();
+    stats = AccelStats();
+    nodes.clear();
+    blocks.clear();
+    std::vector<AABB> bounds(primitives.size());
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < primitives.size(); i++)
+        bounds[i] = AABB(primitives.getVertex(i, 0), primitives.getVertex(i, 1), primitives.getVertex(i, 2));
+    stats.addPhase("bounds", start);
+    std::vector<int> primitiveIndices;
+    buildTree(bounds, primitives, method, nodes, primitiveIndices);
+    stats.addPhase("build", start);
+    // leaves refer to precomputed triangle blocks instead of indices
+    blocks.reserve(primitives.size() / TRIANGLE_BLOCK_SIZE + nodes.size() / 2 + 1);
+    for (auto& node : nodes) {
+        if (node.nPrimitives == 0) continue;
+        node.primitivesOffset = packTriangleBlocks(primitives,
+            primitiveIndices.data() + node.primitivesOffset, node.nPrimitives, blocks);
+    }
+    blocks.shrink_to_fit();
+    stats.addPhase("pack", start);
+    linkParents();
+    updateStats();
+    buildCost = stats.sahCost;
+}
+
+void KdTreeAccel::linkParents() {
+    parents.assign(nodes.size(), -1);
+    for (int i = 0; i < static_cast<int>(nodes.size()); i++) {
+        if (nodes[i].nPrimitives > 0) continue;
+        parents[i + 1] = i;
+        parents[nodes[i].secondChildOffset] = i;
+    }
+}
+
+void KdTreeAccel::updateStats() {
+    AccelStats shape = computeTreeStats(nodes);
+    shape.phaseTimes = std::move(stats.phaseTimes);
+    stats = std::move(shape);
+    stats.type = "kd-tree" + buildMethodSuffix(method);
+    stats.primitives = primitives.size();
+    stats.memoryBytes = nodes.size() * sizeof(LinearKdTreeNode) + parents.size() * sizeof(int) +
+        blocks.size() * sizeof(TriangleBlock);
+}
+
+Float KdTreeAccel::getBytesPerTriangle() const {
+    if (primitives.empty()) return 0;
+    return static_cast<Float>(stats.memoryBytes) / static_cast<Float>(primitives.size());
+}
+
+bool KdTreeAccel::refit() {
+    if (nodes.empty()) return false;
+    // the blocks hold copies of the vertices
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int b = 0; b < static_cast<int>(blocks.size()); b++) {
+        for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+            if (blocks[b].primId[lane] >= 0)
+                setBlockLane(blocks[b], lane, primitives, blocks[b].primId[lane]);
+        }
+    }
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < static_cast<int>(nodes.size()); i++) {
+        LinearKdTreeNode& node = nodes[i];
+        if (node.nPrimitives == 0) continue;
+        int nBlocks = (node.nPrimitives + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+        bool first = true;
+        for (int b = 0; b < nBlocks; b++) {
+            const TriangleBlock& block = blocks[node.primitivesOffset + b];
+            for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+                int prim = block.primId[lane];
+                if (prim < 0) continue;
+                AABB box(primitives.getVertex(prim, 0), primitives.getVertex(prim, 1),
+                    primitives.getVertex(prim, 2));
+                node.box = first ? box : AABB(node.box, box);
+                first = false;
+            }
+        }
     }
-    else if (left_result) interaction = tmp_left_interaction;
-    else if (right_result) interaction = tmp_right_interaction;
-    return left_result || right_result;
+    refitInteriorNodes(nodes);
+    stats.sahCost = computeSahCost(nodes);
+    if (stats.sahCost <= buildCost * REFIT_REBUILD_RATIO) return false;
+    build();
+    return true;
 }
 
-KdTreeNode::~KdTreeNode() {
-    if (leftChild) {
-        delete leftChild;
-        leftChild = nullptr;
+void KdTreeAccel::save(SnapshotWriter& out) const {
+    const auto& meshes = primitives.getMeshes();
+    out.write(static_cast<int>(meshes.size()));
+    for (auto& mesh : meshes) out.writeMesh(*mesh);
+    out.writeArray(primitives.getLightIds());
+    out.writeArray(nodes);
+    out.writeArray(blocks);
+}
+
+std::shared_ptr<KdTreeAccel> KdTreeAccel::load(SnapshotReader& in) {
+    std::shared_ptr<KdTreeAccel> accel(new KdTreeAccel());
+    int nMeshes = in.read<int>();
+    std::vector<std::shared_ptr<Mesh>> meshes;
+    for (int i = 0; i < nMeshes && in.ok(); i++) meshes.push_back(in.readMesh());
+    std::vector<int> lightIds;
+    in.readArray(lightIds);
+    in.readArray(accel->nodes);
+    in.readArray(accel->blocks);
+    if (!in.ok() || (!lightIds.empty() && lightIds.size() != meshes.size()))
+        return nullptr;
+    accel->primitives = MeshPrimitives(std::move(meshes), std::move(lightIds));
+    // a damaged snapshot must not send the traversal outside the arrays
+    if (!isValidTree(accel->nodes, accel->blocks.size(), TRIANGLE_BLOCK_SIZE)) return nullptr;
+    for (const TriangleBlock& block : accel->blocks) {
+        for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+            if (block.primId[lane] < -1 || block.primId[lane] >= accel->primitives.size())
+                return nullptr;
+        }
+    }
+    accel->linkParents();
+    accel->updateStats();
+    accel->buildCost = accel->stats.sahCost;
+    return accel;
+}
+
+int packTriangleBlocks(const MeshPrimitives& primitives, const int* indices,
+    int count, std::vector<TriangleBlock>& blocks) {
+    int first = static_cast<int>(blocks.size());
+    for (int i = 0; i < count; i += TRIANGLE_BLOCK_SIZE) {
+        TriangleBlock block;
+        fillTriangleBlock(primitives, indices + i, std::min(count - i, TRIANGLE_BLOCK_SIZE), block);
+        blocks.push_back(block);
+    }
+    return first;
+}
+
+void fillTriangleBlock(const MeshPrimitives& primitives, const int* indices,
+    int count, TriangleBlock& block) {
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+        if (lane >= count) {
+            // degenerate triangle, its determinant is always 0
+            for (int a = 0; a < 3; a++)
+                block.v0[a][lane] = block.e1[a][lane] = block.e2[a][lane] = 0;
+            block.primId[lane] = -1;
+            continue;
+        }
+        setBlockLane(block, lane, primitives, indices[lane]);
+        block.primId[lane] = indices[lane];
+    }
+}
+
+int intersectTriangleBlock(const TriangleBlock& block, const Ray& ray, Float& t,
+    Float& u, Float& v, int laneMask) {
+    alignas(16) Float tLane[TRIANGLE_BLOCK_SIZE], uLane[TRIANGLE_BLOCK_SIZE], vLane[TRIANGLE_BLOCK_SIZE];
+    int mask = 0;
+#if defined(ACCEL_USE_SSE)
+    static_assert(TRIANGLE_BLOCK_SIZE == 4, "the SSE kernel tests 4 triangles");
+    const __m128 dx = _mm_set1_ps(ray.direction[0]), dy = _mm_set1_ps(ray.direction[1]),
+        dz = _mm_set1_ps(ray.direction[2]);
+    const __m128 e1x = _mm_load_ps(block.e1[0]), e1y = _mm_load_ps(block.e1[1]),
+        e1z = _mm_load_ps(block.e1[2]);
+    const __m128 e2x = _mm_load_ps(block.e2[0]), e2y = _mm_load_ps(block.e2[1]),
+        e2z = _mm_load_ps(block.e2[2]);
+    // pvec = direction x e2
+    __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    // tvec = origin - v0
+    __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.origin[0]), _mm_load_ps(block.v0[0]));
+    __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.origin[1]), _mm_load_ps(block.v0[1]));
+    __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.origin[2]), _mm_load_ps(block.v0[2]));
+    __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+    // qvec = tvec x e1
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+    __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    __m128 valid = _mm_cmpneq_ps(det, zero);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(ray.tMin)),
+        _mm_cmple_ps(tt, _mm_set1_ps(ray.tMax))));
+    mask = _mm_movemask_ps(valid) & laneMask;
+    if (!mask) return -1;
+    _mm_store_ps(tLane, tt);
+    _mm_store_ps(uLane, uu);
+    _mm_store_ps(vLane, vv);
+#else
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+        if (!(laneMask & (1 << lane))) continue;
+        vec3 e1(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+        vec3 e2(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+        vec3 pvec = ray.direction.cross(e2);
+        Float det = e1.dot(pvec);
+        if (det == 0) continue;
+        Float invDet = 1.0 / det;
+        vec3 tvec = ray.origin - vec3(block.v0[0][lane], block.v0[1][lane], block.v0[2][lane]);
+        Float uu = tvec.dot(pvec) * invDet;
+        if (uu < 0 || uu > 1) continue;
+        vec3 qvec = tvec.cross(e1);
+        Float vv = ray.direction.dot(qvec) * invDet;
+        if (vv < 0 || uu + vv > 1) continue;
+        Float tt = e2.dot(qvec) * invDet;
+        if (tt < ray.tMin || tt > ray.tMax) continue;
+        tLane[lane] = tt;
+        uLane[lane] = uu;
+        vLane[lane] = vv;
+        mask |= 1 << lane;
     }
-    if (rightChild) {
-        delete rightChild;
-        rightChild = nullptr;
+    if (!mask) return -1;
+#endif
+    int best = -1;
+    for (int lane = 0; lane < TRIANGLE_BLOCK_SIZE; lane++) {
+        if ((mask & (1 << lane)) && (best == -1 || tLane[lane] < tLane[best])) best = lane;
     }
+    t = tLane[best];
+    u = uLane[best];
+    v = vLane[best];
+    return best;
 }
 
-KdTreeAccel::KdTreeAccel(
-    const std::vector<std::shared_ptr<Triangle>>& triangles) {
-    AABB box;
-    for (auto& tri : triangles)
-        box = AABB(box,
-            AABB(tri->getVertex(0), tri->getVertex(1), tri->getVertex(2)));
-    root = std::move(std::make_unique<KdTreeNode>(triangles, box, 0));
+/**
+ * ray-accel intersect, children are visited front to back and the ray is
+ * clipped at the closest hit so far, so subtrees behind it are skipped
+ * @param[out] hit the closest triangle and its barycentrics
+ * @param[in] ray the given ray
+ * @return whether ray hit any triangle
+ */
+bool KdTreeAccel::intersectHit(HitRecord& hit, const Ray& ray) const {
+    if (nodes.empty()) return false;
+    Ray clipped = ray;
+    bool dirIsNeg[3] = { ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0 };
+    bool found = false;
+    int nodesToVisit[64];
+    int toVisitOffset = 0;
+    int current = 0;
+    while (true) {
+        const LinearKdTreeNode& node = nodes[current];
+        Float tIn, tOut;
+        TRAVERSAL_COUNT_NODE();
+        if (node.box.rayIntersection(clipped, tIn, tOut) && tIn <= clipped.tMax) {
+            if (node.nPrimitives > 0) {
+                TRAVERSAL_COUNT_TRIANGLES(node.nPrimitives);
+                // a leaf only reports hits closer than clipped.tMax
+                found |= intersectLeaf(&blocks[node.primitivesOffset], node.nPrimitives, clipped, hit);
+            }
+            else if (dirIsNeg[node.axis]) {
+                // the second child is nearer, visit it first
+                nodesToVisit[toVisitOffset++] = current + 1;
+                current = node.secondChildOffset;
+                continue;
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        current = nodesToVisit[--toVisitOffset];
+    }
+    return found;
 }
 
-bool KdTreeAccel::intersect(Interaction& interaction, const Ray& ray) const {
-    if (root) return root->intersect(interaction, ray);
+void KdTreeAccel::resolveHit(Interaction& interaction, const HitRecord& hit,
+    const Ray& ray) const {
+    primitives.resolve(interaction, hit, ray);
+}
+
+/**
+ * any-hit traversal for shadow rays, stops at the first triangle found on
+ * the segment, light triangles do not occlude
+ * @param[in] ray the given ray
+ * @param[in] maxDist the end of the segment
+ * @return whether anything is hit between ray.tMin and maxDist
+ */
+bool KdTreeAccel::occluded(const Ray& ray, Float maxDist) const {
+    if (nodes.empty()) return false;
+    Ray segment = ray;
+    segment.tMax = std::min(maxDist, ray.tMax);
+    maxDist = segment.tMax;
+    bool dirIsNeg[3] = { ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0 };
+    int nodesToVisit[64];
+    int toVisitOffset = 0;
+    int current = 0;
+    while (true) {
+        const LinearKdTreeNode& node = nodes[current];
+        Float tIn, tOut;
+        TRAVERSAL_COUNT_NODE();
+        if (node.box.rayIntersection(ray, tIn, tOut) && tIn <= maxDist) {
+            if (node.nPrimitives > 0) {
+                TRAVERSAL_COUNT_TRIANGLES(node.nPrimitives);
+                if (occludedLeaf(&blocks[node.primitivesOffset], node.nPrimitives, primitives, segment))
+                    return true;
+            }
+            else if (dirIsNeg[node.axis]) {
+                nodesToVisit[toVisitOffset++] = current + 1;
+                current = node.secondChildOffset;
+                continue;
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        current = nodesToVisit[--toVisitOffset];
+    }
     return false;
 }
 
+namespace {
+
+/**
+ * walk a flattened tree without a stack (Hapala et al., "Efficient
+ * Stack-less BVH Traversal"). A node is entered from its parent, from its
+ * sibling or from one of its children, which together with the parent links
+ * tells where to go next: the near child first, then its sibling, then back
+ * up once both are done.
+ * @param[in] nodes, parents the tree and the parent of every node
+ * @param[in] ray the ray the boxes are tested with, may be clipped by visitLeaf
+ * @param[in] dirIsNeg sign of the ray direction, decides the near child
+ * @param[in] visitLeaf called for every leaf the ray enters, returns true to
+ *            end the traversal
+ */
+template <typename VisitLeaf>
+void traverseStackless(const std::vector<LinearKdTreeNode>& nodes,
+    const std::vector<int>& parents, const Ray& ray, const bool dirIsNeg[3],
+    VisitLeaf&& visitLeaf) {
+    enum class From { PARENT, SIBLING, CHILD };
+    auto nearChild = [&](int i) {
+        return dirIsNeg[nodes[i].axis] ? nodes[i].secondChildOffset : i + 1;
+    };
+    auto sibling = [&](int i) {
+        int parent = parents[i];
+        return i == parent + 1 ? nodes[parent].secondChildOffset : parent + 1;
+    };
+    auto enters = [&](int i) {
+        Float tIn, tOut;
+        TRAVERSAL_COUNT_NODE();
+        return nodes[i].box.rayIntersection(ray, tIn, tOut) && tIn <= ray.tMax;
+    };
+    if (!enters(0)) return;
+    if (nodes[0].nPrimitives > 0) {
+        visitLeaf(nodes[0]);
+        return;
+    }
+    int current = nearChild(0);
+    From from = From::PARENT;
+    while (true) {
+        if (from == From::CHILD) {
+            if (current == 0) return;
+            int parent = parents[current];
+            if (current == nearChild(parent)) {
+                current = sibling(current);
+                from = From::SIBLING;
+            }
+            else {
+                current = parent;
+            }
+            continue;
+        }
+        const LinearKdTreeNode& node = nodes[current];
+        if (enters(current) && node.nPrimitives == 0) {
+            current = nearChild(current);
+            from = From::PARENT;
+            continue;
+        }
+        if (node.nPrimitives > 0 && visitLeaf(node)) return;
+        // the subtree is done, a near child continues with its sibling
+        if (from == From::PARENT) {
+            current = sibling(current);
+            from = From::SIBLING;
+        }
+        else {
+            current = parents[current];
+            from = From::CHILD;
+        }
+    }
+}
+
+}  // namespace
+
+bool KdTreeAccel::intersectHitStackless(HitRecord& hit, const Ray& ray) const {
+    if (nodes.empty()) return false;
+    Ray clipped = ray;
+    bool dirIsNeg[3] = { ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0 };
+    bool found = false;
+    traverseStackless(nodes, parents, clipped, dirIsNeg, [&](const LinearKdTreeNode& node) {
+        TRAVERSAL_COUNT_TRIANGLES(node.nPrimitives);
+        found |= intersectLeaf(&blocks[node.primitivesOffset], node.nPrimitives, clipped, hit);
+        return false;
+    });
+    return found;
+}
+
+bool KdTreeAccel::occludedStackless(const Ray& ray, Float maxDist) const {
+    if (nodes.empty()) return false;
+    Ray segment = ray;
+    segment.tMax = std::min(maxDist, ray.tMax);
+    bool dirIsNeg[3] = { ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0 };
+    bool occluded = false;
+    traverseStackless(nodes, parents, segment, dirIsNeg, [&](const LinearKdTreeNode& node) {
+        TRAVERSAL_COUNT_TRIANGLES(node.nPrimitives);
+        return occluded = occludedLeaf(&blocks[node.primitivesOffset], node.nPrimitives, primitives, segment);
+    });
+    return occluded;
+}
+
+/**
+ * intersect a packet of coherent rays, every node is fetched once for the
+ * whole packet and tested against all active rays
+ * @param[in] packet the given rays
+ * @param[out] hits output intersect infos of every ray
+ */
+void KdTreeAccel::intersect(const RayPacket<RAY_PACKET_SIZE>& packet,
+    HitPacket<RAY_PACKET_SIZE>& hits) const {
+    constexpr int N = RAY_PACKET_SIZE;
+    static_assert(N <= 32, "ray masks are stored in 32 bits");
+    for (int i = 0; i < N; i++) hits.hit[i] = false;
+    if (nodes.empty() || packet.size == 0) return;
+
+    // SoA copies of the rays for the box tests, inactive lanes never hit
+    alignas(32) Float origin[3][N], invDir[3][N], tMin[N], tMax[N];
+    Ray clipped[N];
+    HitRecord hit[N];
+    for (int i = 0; i < N; i++) {
+        const Ray& ray = packet.rays[i < packet.size ? i : 0];
+        clipped[i] = ray;
+        for (int a = 0; a < 3; a++) {
+            origin[a][i] = ray.origin[a];
+            invDir[a][i] = (ray.direction[a] == 0) ? INF : Float(1) / ray.direction[a];
+        }
+        tMin[i] = ray.tMin;
+        tMax[i] = i < packet.size ? ray.tMax : -INF;
+    }
+    // the packet is coherent, so the first ray decides the visiting order
+    const Ray& first = packet.rays[0];
+    bool dirIsNeg[3] = { first.direction[0] < 0, first.direction[1] < 0, first.direction[2] < 0 };
+
+    struct StackEntry {
+        int node;
+        uint32_t mask;
+    };
+    StackEntry nodesToVisit[64];
+    int toVisitOffset = 0;
+    int current = 0;
+    uint32_t mask = (1u << packet.size) - 1;
+    while (true) {
+        const LinearKdTreeNode& node = nodes[current];
+        uint32_t hitMask = 0;
+        TRAVERSAL_COUNT_PACKET_NODE(mask);
+#if defined(ACCEL_USE_SSE)
+        for (int c = 0; c < N; c += 4) {
+            __m128 t0 = _mm_load_ps(tMin + c), t1 = _mm_load_ps(tMax + c);
+            for (int a = 0; a < 3; a++) {
+                __m128 o = _mm_load_ps(origin[a] + c), inv = _mm_load_ps(invDir[a] + c);
+                __m128 tl = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.box.lb[a]), o), inv);
+                __m128 tu = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.box.ub[a]), o), inv);
+                t0 = _mm_max_ps(t0, _mm_min_ps(tl, tu));
+                t1 = _mm_min_ps(t1, _mm_max_ps(tl, tu));
+            }
+            hitMask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(t0, t1))) << c;
+        }
+#else
+        for (int i = 0; i < N; i++) {
+            Float t0 = tMin[i], t1 = tMax[i];
+            for (int a = 0; a < 3; a++) {
+                Float tl = (node.box.lb[a] - origin[a][i]) * invDir[a][i];
+                Float tu = (node.box.ub[a] - origin[a][i]) * invDir[a][i];
+                t0 = std::max(t0, std::min(tl, tu));
+                t1 = std::min(t1, std::max(tl, tu));
+            }
+            if (t0 <= t1) hitMask |= 1u << i;
+        }
+#endif
+        hitMask &= mask;
+        if (hitMask) {
+            if (node.nPrimitives > 0) {
+                for (uint32_t m = hitMask; m; m &= m - 1) {
+                    int i = 0;
+                    while (!(m & (1u << i))) i++;
+                    TRAVERSAL_COUNT_PACKET_TRIANGLES(i, node.nPrimitives);
+                    if (intersectLeaf(&blocks[node.primitivesOffset], node.nPrimitives, clipped[i], hit[i]))
+                        tMax[i] = clipped[i].tMax;
+                }
+            }
+            else if (dirIsNeg[node.axis]) {
+                nodesToVisit[toVisitOffset++] = { current + 1, hitMask };
+                current = node.secondChildOffset;
+                mask = hitMask;
+                continue;
+            }
+            else {
+                nodesToVisit[toVisitOffset++] = { node.secondChildOffset, hitMask };
+                current = current + 1;
+                mask = hitMask;
+                continue;
+            }
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        current = nodesToVisit[toVisitOffset].node;
+        mask = nodesToVisit[toVisitOffset].mask;
+    }
+    for (int i = 0; i < packet.size; i++) {
+        if (hit[i].primId < 0) continue;
+        primitives.resolve(hits.interactions[i], hit[i], packet.rays[i]);
+        hits.hit[i] = true;
+    }
+}
+
 AABB::AABB(Float lbX, Float lbY, Float lbZ, Float ubX, Float ubY, Float ubZ) {
     lb = vec3(lbX, lbY, lbZ);
     ub = vec3(ubX, ubY, ubZ);
@@ -245,10 +1376,14 @@ bool AABB::pointIntersection(const vec3 pos)
 }
 
 Float AABB::computeCost(int triangle_num)
+{
+    return surfaceArea() * (Float)triangle_num;
+}
+
+Float AABB::surfaceArea() const
 {
     Float lenx = getDist(0);
     Float leny = getDist(1);
     Float lenz = getDist(2);
-    Float P = 2 * ((lenx * leny) + (lenx * lenz) + (leny * lenz));
-    return P * (Float)triangle_num;
+    return 2 * ((lenx * leny) + (lenx * lenz) + (leny * lenz));
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+#include <cornell_box.h>
+#include <geometry.h>
+#include <obj_loader.h>
+#include <instance.h>
+#include <snapshot.h>
+#include <texture.h>
+#include <algorithm>
+#include <cstdint>
+
+//#include <filesystem>
+
+std::string getPath(const std::string& target, int depth) {
+    std::string path = target;
+    for (int i = 0; i < depth; ++i) {
+        FILE* file = fopen(path.c_str(), "r");
+        if (file) {
+            fclose(file);
+            return path;
+        }
+        path = "../" + path;
+    }
+    return target;
+}
+
+std::shared_ptr<Camera> genCamera(int id, const vec2i &res) {
+  vec3 cameraPos;
+  vec3 cameraLookAt;
+  Float fov = 45;
+  if (id == 0 || id == 1 || id == 2 || id == 3 || id == 4) {
+    cameraPos = vec3(0, 1, 6.8);
+    cameraLookAt = vec3(0, 1, 0);
+    fov = 19;
+  }
+  if (id == 5) {
+      cameraPos = vec3(0, 1.5, 6.8);
+      cameraLookAt = vec3(0, 1, 0);
+      fov = 19;
+  }
+  if (id == 6)
+  {
+      cameraPos = vec3(0, 2, 4.8);
+      cameraLookAt = vec3(0, 0, 0);
+      fov = 18;
+  }
+  auto camera = makeCamera(cameraPos, fov, res);
+  camera->lookAt(cameraLookAt, vec3(0, 1, 0));
+  return camera;
+}
+
+namespace {
+
+/**
+ * An OBJ mesh placed in a scene, the arguments of makeObjMesh
+ * With instances > 0 the mesh is loaded once and shared by that many
+ * instances on a circle of radius 0.6 around the origin instead.
+ */
+struct ObjPlacement {
+  std::string path;
+  int material;  // index into the material table of genCornellBoxScene
+  Float scale;
+  vec3 translation;
+  vec3 rotation;
+  int instances;
+};
+
+/* OBJ meshes of a scene in the order they are added */
+std::vector<ObjPlacement> objPlacements(int id) {
+  // material indices, see the material table of genCornellBoxScene
+  constexpr int shortBox = 5, mirror = 7, glass = 8, ice = 9;
+  std::vector<ObjPlacement> placements;
+  if (id == 1)
+    placements.push_back({"assets/sphere.obj", mirror, 1, vec3(0, 0, 0), vec3::Zero(), 0});
+  if (id == 2 || id == 3 || id == 4)
+    placements.push_back({"assets/stanford_dragon.obj", shortBox, 5, vec3(0, 0.1, 0), vec3::Zero(), 0});
+  if (id == 3)
+    placements.push_back({"assets/stanford_bunny.obj", shortBox, 2, vec3::Zero(), vec3::Zero(), 7});
+  if (id == 4)
+    placements.push_back({"assets/stanford_dragon.obj", shortBox, 2, vec3::Zero(), vec3::Zero(), 7});
+  if (id == 5) {
+    placements.push_back({"assets/sphere.obj", mirror, 1, vec3(-0.7, 0.3, 0), vec3::Zero(), 0});
+    placements.push_back({"assets/sphere.obj", glass, 1, vec3(0, 0, 0), vec3::Zero(), 0});
+    placements.push_back({"assets/custom_scene/Ocean.obj", ice, 0.5, vec3(0, 0.5, 0), vec3(0, 0, 0), 0});
+  }
+  if (id == 6)
+    placements.push_back({"assets/stanford_dragon.obj", ice, 4, vec3(0, -0.1, 0.7), vec3::Zero(), 0});
+  return placements;
+}
+
+/**
+ * hash of everything the prepared geometry of a scene is built from: the
+ * scene id, the meshes built in code (including those of the area lights),
+ * the OBJ placements and the content of the OBJ files. Code that shapes the
+ * geometry outside of these, e.g. the circle of instances, is covered by
+ * SCENE_DESCRIPTION_VERSION, bump it after changing such code.
+ */
+uint64_t hashSceneInputs(int id, const std::vector<std::shared_ptr<Geometry>> &meshes,
+                         const std::vector<ObjPlacement> &placements,
+                         const std::vector<std::shared_ptr<BRDF>> &materials) {
+  constexpr uint32_t SCENE_DESCRIPTION_VERSION = 1;
+  uint64_t hash = hashBytes(&SNAPSHOT_VERSION, sizeof(SNAPSHOT_VERSION));
+  hash = hashBytes(&SCENE_DESCRIPTION_VERSION, sizeof(SCENE_DESCRIPTION_VERSION), hash);
+  hash = hashBytes(&id, sizeof(id), hash);
+  auto hashVector = [&hash](const auto &vec) {
+    hash = hashBytes(vec.data(), vec.size() * sizeof(vec[0]), hash);
+  };
+  for (auto &geom : meshes) {
+    auto mesh = std::dynamic_pointer_cast<Mesh>(geom);
+    if (!mesh) continue;
+    hashVector(mesh->getMesh()->indices);
+    hashVector(mesh->getMesh()->p);
+    hashVector(mesh->getMesh()->n);
+    hashVector(mesh->getMesh()->uv);
+    int material = static_cast<int>(
+        std::find(materials.begin(), materials.end(), mesh->getMaterial()) - materials.begin());
+    hash = hashBytes(&material, sizeof(material), hash);
+  }
+  for (auto &placement : placements) {
+    hash = hashFile(getPath(placement.path), hash);
+    hash = hashBytes(&placement.material, sizeof(placement.material), hash);
+    hash = hashBytes(&placement.scale, sizeof(placement.scale), hash);
+    hash = hashBytes(placement.translation.data(), sizeof(Float) * 3, hash);
+    hash = hashBytes(placement.rotation.data(), sizeof(Float) * 3, hash);
+    hash = hashBytes(&placement.instances, sizeof(placement.instances), hash);
+  }
+  return hash;
+}
+
+}  // namespace
+
+std::shared_ptr<Scene> genCornellBoxScene(int id, const std::string &snapshotPath) {
+  // Material settings
+  auto leftWallMat = makeIdealDiffusion(vec3(0.630000, 0.065000, 0.050000));
+  auto rightWallMat = makeIdealDiffusion(vec3(0.140000, 0.450000, 0.091000));
+  auto floorMat = makeIdealDiffusion(vec3(0.725000, 0.710000, 0.680000));
+  auto ceilingMat = makeIdealDiffusion(vec3(0.725000, 0.710000, 0.680000));
+  auto backWallMat = makeIdealDiffusion(vec3(0.725000, 0.710000, 0.680000));
+  auto shortBoxMat = makeIdealDiffusion(vec3(0.725000, 0.710000, 0.680000));
+  auto tallBoxMat = makeIdealDiffusion(vec3(0.725000, 0.710000, 0.680000));
+  auto mirrorMat = makeIdealSpecular();
+  //auto tranparentMat = makeIdealTransmission();
+  auto glassMat = makeTranslucent(0.667, vec3(1, 1, 1));
+  auto iceMat = makeTranslucent(0.667, vec3(191, 239, 255) / 255.0);
+  auto metalMat = makeGlossy(50);
+
+  //std::cout << "Current path is " << std::filesystem::current_path() << '\n';
+  auto woodTex = makeMaterialTexture(getPath("assets/textures/1.jpg"));
+  auto cartTex = makeMaterialTexture(getPath("assets/textures/1.jpg"));
+  auto woodMat = makeTextureMaterial(woodTex, 16.0);
+  auto cartMat = makeTextureMaterial(cartTex, 16.0);
+
+  // Light setting
+  std::shared_ptr<Light> light;
+  std::vector<std::shared_ptr<Light>> lights;
+  if (id == 0)
+  {
+    vec3 lightPos;
+    vec3 lightColor;
+    vec2 lightSize;
+
+    lightPos = vec3(-0.005, 1.98, -0.03);
+    lightColor = vec3(17.0, 12.0, 4.0) * 2;
+    lightSize = vec2(0.235, 0.19);
+    light = makeAreaLight(lightPos, lightColor, lightSize);
+
+    lights.push_back(light);
+  }
+  if (id > 0 &&id <= 5 )
+  {
+      vec3 lightPos;
+      vec3 lightColor;
+      vec2 lightSize;
+
+      lightPos = vec3(0.505, 1.98, -0.03);
+      lightColor = vec3(17.0, 12.0, 4.0) * 4;
+      lightSize = vec2(0.235, 0.19);
+      light = makeAreaLight(lightPos, lightColor, lightSize);
+
+      //lights.push_back(light);
+
+      //second light
+      lightPos = vec3(0.005, 1.98, -0.03);
+      lightColor = vec3(17.0, 12.0, 4.0);
+      lightSize = vec2(0.47, 0.38);
+      lights.push_back(makeAreaLight(lightPos, lightColor, lightSize));
+  }
+  if (id == 6)
+  {
+      vec3 lightPos;
+      vec3 lightColor;
+
+      lightPos = vec3(0.005, 1.98, -0.03);
+      lightColor = vec3(17.0, 12.0, 4.0);
+      light = makePointLight(lightPos, lightColor);
+
+      //lights.push_back(light);
+
+      //second light
+      lightPos = vec3(-0.505, 0.98, -0.03);
+      lightColor = vec3(17.0, 12.0, 4.0) * 2;
+      lights.push_back(makePointLight(lightPos, lightColor));
+
+
+  }
+
+
+  // Scene setup
+  std::shared_ptr<Scene> scene;
+  if (lights.empty())
+    scene = std::make_shared<Scene>(light);
+  else
+    scene = std::make_shared<Scene>(lights);
+  auto makeVec2 = [](const std::vector<Float> &vec) {
+    std::vector<vec2> ret;
+    for (int i = 0; i < static_cast<int>(vec.size()); i += 2) {
+      ret.emplace_back(vec[i], vec[i + 1]);
+    }
+    return ret;
+  };
+  auto makeVec3 = [](const std::vector<Float> &vec) {
+    std::vector<vec3> ret;
+    for (int i = 0; i < static_cast<int>(vec.size()); i += 3) {
+      ret.emplace_back(vec[i], vec[i + 1], vec[i + 2]);
+    }
+    return ret;
+  };
+  // a box
+  // clang-format off
+  std::vector<int> index{0, 2, 1, 0, 3, 2, 4, 6, 5, 4, 7, 6, 8, 10, 9, 8, 11, 10, 12, 14, 13, 12, 15, 14, 16, 18, 17, 16, 19, 18, 20, 22, 21, 20, 23, 22};
+  std::vector<vec3> pos = makeVec3({ -0.720444, 1.2, -0.473882, -0.720444, 0.01, -0.473882, -0.146892, 0.01, -0.673479, -0.146892, 1.2, -0.673479, -0.523986, 0.01, 0.0906493, -0.523986, 1.2, 0.0906492, 0.0495656, 1.2, -0.108948, 0.0495656, 0.01, -0.108948, -0.523986, 1.2, 0.0906492, -0.720444, 1.2, -0.473882, -0.146892, 1.2, -0.673479, 0.0495656, 1.2, -0.108948, 0.0495656, 0.01, -0.108948, -0.146892, 0.01, -0.673479, -0.720444, 0.01, -0.473882, -0.523986, 0.01, 0.0906493, -0.523986, 0.01, 0.0906493, -0.720444, 0.01, -0.473882, -0.720444, 1.2, -0.473882, -0.523986, 1.2, 0.0906492, 0.0495656, 1.2, -0.108948, -0.146892, 1.2, -0.673479, -0.146892, 0.01, -0.673479, 0.0495656, 0.01, -0.108948 });
+  std::vector<vec3> normals = makeVec3({ -0.328669, -4.1283e-008, -0.944445, -0.328669, -4.1283e-008, -0.944445, -0.328669, -4.1283e-008, -0.944445, -0.328669, -4.1283e-008, -0.944445, 0.328669, 4.1283e-008, 0.944445, 0.328669, 4.1283e-008, 0.944445, 0.328669, 4.1283e-008, 0.944445, 0.328669, 4.1283e-008, 0.944445, 3.82137e-015, 1, -4.37114e-008, 3.82137e-015, 1, -4.37114e-008, 3.82137e-015, 1, -4.37114e-008, 3.82137e-015, 1, -4.37114e-008, -3.82137e-015, -1, 4.37114e-008, -3.82137e-015, -1, 4.37114e-008, -3.82137e-015, -1, 4.37114e-008, -3.82137e-015, -1, 4.37114e-008, -0.944445, 1.43666e-008, 0.328669, -0.944445, 1.43666e-008, 0.328669, -0.944445, 1.43666e-008, 0.328669, -0.944445, 1.43666e-008, 0.328669, 0.944445, -1.43666e-008, -0.328669, 0.944445, -1.43666e-008, -0.328669, 0.944445, -1.43666e-008, -0.328669, 0.944445, -1.43666e-008, -0.328669 });
+  std::vector<vec2> uv = makeVec2({ 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1 });
+  auto tallBox = makeTriangleMesh(index, static_cast<int>(pos.size()), pos, normals, uv, tallBoxMat);
+
+  // shortBox
+  pos = makeVec3({ -0.0460751, 0.6, 0.573007, -0.0460751, 0.01, 0.573007, 0.124253, 0.01, 0.00310463, 0.124253, 0.6, 0.00310463, 0.533009, 0.01, 0.746079, 0.533009, 0.6, 0.746079, 0.703337, 0.6, 0.176177, 0.703337, 0.01, 0.176177, 0.533009, 0.6, 0.746079, -0.0460751, 0.6, 0.573007, 0.124253, 0.6, 0.00310463, 0.703337, 0.6, 0.176177, 0.703337, 0.01, 0.176177, 0.124253, 0.01, 0.00310463, -0.0460751, 0.01, 0.573007, 0.533009, 0.01, 0.746079, 0.533009, 0.01, 0.746079, -0.0460751, 0.01, 0.573007, -0.0460751, 0.6, 0.573007, 0.533009, 0.6, 0.746079, 0.703337, 0.6, 0.176177, 0.124253, 0.6, 0.00310463, 0.124253, 0.01, 0.00310463, 0.703337, 0.01, 0.176177 });
+  normals = makeVec3({ -0.958123, -4.18809e-008, -0.286357, -0.958123, -4.18809e-008, -0.286357, -0.958123, -4.18809e-008, -0.286357, -0.958123, -4.18809e-008, -0.286357, 0.958123, 4.18809e-008, 0.286357, 0.958123, 4.18809e-008, 0.286357, 0.958123, 4.18809e-008, 0.286357, 0.958123, 4.18809e-008, 0.286357, -4.37114e-008, 1, -1.91069e-015, -4.37114e-008, 1, -1.91069e-015, -4.37114e-008, 1, -1.91069e-015, -4.37114e-008, 1, -1.91069e-015, 4.37114e-008, -1, 1.91069e-015, 4.37114e-008, -1, 1.91069e-015, 4.37114e-008, -1, 1.91069e-015, 4.37114e-008, -1, 1.91069e-015, -0.286357, -1.25171e-008, 0.958123, -0.286357, -1.25171e-008, 0.958123, -0.286357, -1.25171e-008, 0.958123, -0.286357, -1.25171e-008, 0.958123, 0.286357, 1.25171e-008, -0.958123, 0.286357, 1.25171e-008, -0.958123, 0.286357, 1.25171e-008, -0.958123, 0.286357, 1.25171e-008, -0.958123 });
+  auto shortBox = makeTriangleMesh(index, static_cast<int>(pos.size()), pos, normals, uv, glassMat);
+  // clang-format on
+
+  // the Cornell box geometry
+  std::vector<std::shared_ptr<Geometry>> floor;
+  if (id <= 5)
+  {
+      index = { 0, 1, 2, 0, 2, 3 };
+      pos = makeVec3({ -1, 0, -1, -1, 0, 1, 1, -0, 1, 1, -0, -1 });
+      normals = makeVec3({ 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0 });
+      uv = makeVec2({ 0, 0, 1, 0, 1, 1, 0, 1 });
+      floor = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+          normals, uv, floorMat);
+  }
+  if (id == 6)
+  {
+      index = { 0, 1, 2, 0, 2, 3 };
+      pos = makeVec3({ -5, 0, -5, -5, 0, 5, 5, -0, 5, 5, -0, -5 });
+      normals = makeVec3({ 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0 });
+      uv = makeVec2({ 0, 0, 1, 0, 1, 1, 0, 1 });
+      floor = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+          normals, uv, woodMat);
+  }
+
+  pos = makeVec3({1, 2, 1, -1, 2, 1, -1, 2, -1, 1, 2, -1});
+  normals = makeVec3({0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0});
+  auto ceiling = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+                                  normals, uv, ceilingMat);
+
+  pos = makeVec3({-1, 0, -1, -1, 2, -1, 1, 2, -1, 1, 0, -1});
+  normals = makeVec3({0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1});
+  auto backWall = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+                                   normals, uv, backWallMat);
+
+  pos = makeVec3({1, 0, -1, 1, 2, -1, 1, 2, 1, 1, 0, 1});
+  normals = makeVec3({-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0});
+  auto rightWall = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+                                    normals, uv, rightWallMat);
+
+  pos = makeVec3({-1, 0, 1, -1, 2, 1, -1, 2, -1, -1, 0, -1});
+  normals = makeVec3({1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0});
+  auto leftWall = makeTriangleMesh(index, static_cast<int>(pos.size()), pos,
+                                   normals, uv, leftWallMat);
+
+  std::vector<std::shared_ptr<Geometry>> codeMeshes;
+  if (id <= 5)
+  {
+      for (auto *mesh : { &backWall, &leftWall, &rightWall, &floor, &ceiling })
+          codeMeshes.insert(codeMeshes.end(), mesh->begin(), mesh->end());
+  }
+  if (id == 6)
+  {
+      codeMeshes.insert(codeMeshes.end(), floor.begin(), floor.end());
+  }
+  if (id == 0 || id == 1) codeMeshes.insert(codeMeshes.end(), tallBox.begin(), tallBox.end());
+  if (id == 0) codeMeshes.insert(codeMeshes.end(), shortBox.begin(), shortBox.end());
+
+  // a warm start maps the prepared geometry and accelerator from a snapshot
+  // instead of loading the OBJ meshes and building the accelerator
+  std::vector<std::shared_ptr<BRDF>> materials{
+      leftWallMat, rightWallMat, floorMat, ceilingMat, backWallMat, shortBoxMat,
+      tallBoxMat, mirrorMat, glassMat, iceMat, metalMat, woodMat, cartMat};
+  std::vector<ObjPlacement> placements = objPlacements(id);
+  uint64_t snapshotKey = 0;
+  if (!snapshotPath.empty()) {
+    std::vector<std::shared_ptr<Geometry>> keyMeshes = codeMeshes;
+    // area lights are part of the accelerator, so is their placement
+    for (auto &lt : lights.empty() ? std::vector<std::shared_ptr<Light>>{light} : lights)
+      for (auto &geom : lt->getGeometries()) keyMeshes.push_back(geom);
+    snapshotKey = hashSceneInputs(id, keyMeshes, placements, materials);
+    if (scene->loadSnapshot(snapshotPath, snapshotKey, materials)) {
+      std::clog << "-- Loaded snapshot " << snapshotPath << std::endl;
+      return scene;
+    }
+  }
+
+  scene->addGeometry(codeMeshes);
+  for (auto &placement : placements) {
+    auto mesh = makeObjMesh(placement.path, materials[placement.material], placement.scale,
+                            placement.translation, placement.rotation);
+    if (placement.instances == 0) {
+      scene->addGeometry(mesh);
+      continue;
+    }
+    // the mesh is loaded and its tree built once, shared by all instances
+    auto object = makeInstanceObject(mesh);
+    for (int i = 0; i < placement.instances; ++i) {
+      Float angle = radians(static_cast<float>(i) / placement.instances * 360.0f);
+      vec3 trans = vec3(cos(angle), 0, sin(angle)) * 0.6f;
+      scene->addGeometry(makeInstance(object, 1, trans));
+    }
+  }
+  if (!snapshotPath.empty()) {
+    scene->buildAccel();
+    scene->saveSnapshot(snapshotPath, snapshotKey, materials);
+  }
+  return scene;
+}
@@ -1,6 +1,8 @@
 #include <film.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
+#include <algorithm>
+#include <fstream>
 
 Film::Film(const vec2i &resolution) : resolution(resolution) {
   this->pixels.resize(resolution.x() * resolution.y());
@@ -25,3 +27,29 @@ void Film::write(const std::string &filePath) const {
   stbi_write_png(filePath.c_str(), resolution.x(), resolution.y(), 3,
                  data.data(), 0);
 }
+
+void writeHeatmap(const std::vector<float> &values, const vec2i &resolution,
+                  const std::string &basePath) {
+  // the PFM header announces the full resolution, a partial buffer would shift the rows
+  assert(values.size() == static_cast<size_t>(resolution.x()) * resolution.y());
+  if (values.size() != static_cast<size_t>(resolution.x()) * resolution.y()) return;
+  // blue - cyan - green - yellow - red
+  const vec3 ramp[5] = {vec3(0, 0, 1), vec3(0, 1, 1), vec3(0, 1, 0), vec3(1, 1, 0),
+                        vec3(1, 0, 0)};
+  float maxValue = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+  Film film(resolution);
+  for (size_t i = 0; i < values.size(); i++) {
+    Float x = maxValue > 0 ? values[i] / maxValue * 4 : 0;
+    int k = std::min(static_cast<int>(x), 3);
+    vec3 color = ramp[k] + (ramp[k + 1] - ramp[k]) * (x - k);
+    // Film::write applies the gamma, undo it to keep the colors of the ramp
+    for (int c = 0; c < 3; c++) film.pixels[i][c] = pow(color[c], 2.2);
+  }
+  film.write(basePath + ".png");
+
+  // single channel PFM, rows go bottom to top like Film::pixels
+  std::ofstream file(basePath + ".pfm", std::ios::binary | std::ios::trunc);
+  file << "Pf\n" << resolution.x() << " " << resolution.y() << "\n-1.0\n";
+  file.write(reinterpret_cast<const char *>(values.data()),
+             static_cast<std::streamsize>(values.size() * sizeof(float)));
+}
@@ -1,17 +1,19 @@
 #include <geometry.h>
 #include <ray.h>
 #include <interaction.h>
+#include <traversal_stats.h>
+
+namespace {
 
 /**
- * ray-triangle intersect
- * @param[out] interaction output intersect infos
+ * Moller-Trumbore ray-triangle test
+ * @param[in] v0, v1, v2 the vertices
  * @param[in] ray the given ray
- * @return whether ray hit the triangle
+ * @param[out] t, u, v distance and barycentric weights of the hit
+ * @return whether ray hit the triangle in [ray.tMin, ray.tMax]
  */
-bool Triangle::intersect(Interaction &interaction, const Ray &ray) const {
-  const vec3 &v0 = mesh->p[v[0]];
-  const vec3 &v1 = mesh->p[v[1]];
-  const vec3 &v2 = mesh->p[v[2]];
+bool intersectTriangle(const vec3 &v0, const vec3 &v1, const vec3 &v2,
+                       const Ray &ray, Float &t, Float &u, Float &v) {
   vec3 v0v1 = v1 - v0;
   vec3 v0v2 = v2 - v0;
   vec3 pvec = ray.direction.cross(v0v2);
@@ -22,25 +24,84 @@ bool Triangle::intersect(Interaction &interaction, const Ray &ray) const {
   Float invDet = 1.0 / det;
 
   vec3 tvec = ray.origin - v0;
-  Float u = tvec.dot(pvec) * invDet;
+  u = tvec.dot(pvec) * invDet;
   if (u < 0 || u > 1) return false;
   vec3 qvec = tvec.cross(v0v1);
-  Float v = ray.direction.dot(qvec) * invDet;
+  v = ray.direction.dot(qvec) * invDet;
   if (v < 0 || u + v > 1) return false;
-  Float t = v0v2.dot(qvec) * invDet;
-  if (t < ray.tMin || t > ray.tMax) return false;
+  t = v0v2.dot(qvec) * invDet;
+  return t >= ray.tMin && t <= ray.tMax;
+}
+
+}  // namespace
+
+/**
+ * ray-mesh intersect, every triangle is tested and the ray is clipped at the
+ * closest hit so far
+ * @param[out] hit the closest triangle and its barycentrics
+ * @param[in] ray the given ray
+ * @return whether ray hit the mesh
+ */
+bool Mesh::intersectHit(HitRecord &hit, const Ray &ray) const {
+  TRAVERSAL_COUNT_TRIANGLES(mesh->nTriangles);
+  Ray clipped = ray;
+  bool found = false;
+  for (int i = 0; i < mesh->nTriangles; i++) {
+    Float t, u, v;
+    if (!intersectTriangle(getVertex(i, 0), getVertex(i, 1), getVertex(i, 2),
+                           clipped, t, u, v))
+      continue;
+    clipped.tMax = t;
+    hit.t = t;
+    hit.primId = i;
+    hit.u = u;
+    hit.v = v;
+    found = true;
+  }
+  return found;
+}
+
+void Mesh::resolveHit(Interaction &interaction, const HitRecord &hit,
+                      const Ray &ray) const {
+  computeInteraction(interaction, ray, hit.primId, hit.t, hit.u, hit.v);
+}
 
+void Mesh::computeInteraction(Interaction &interaction, const Ray &ray,
+                              int triangle, Float t, Float u, Float v) const {
+  const int *index = mesh->indices.data() + 3 * triangle;
   interaction.entryDist = t;
   interaction.entryPoint = ray.getPoint(t);
-  interaction.normal = (u * mesh->n[this->v[1]] + v * mesh->n[this->v[2]] +
-                        (1 - u - v) * mesh->n[this->v[0]])
+  interaction.normal = (u * mesh->n[index[1]] + v * mesh->n[index[2]] +
+                        (1 - u - v) * mesh->n[index[0]])
                            .normalized();
-  interaction.uv = (u * mesh->uv[this->v[1]] + v * mesh->uv[this->v[2]] +
-    (1 - u - v) * mesh->uv[this->v[0]]);
-  interaction.brdf = material;
+  interaction.uv = (u * mesh->uv[index[1]] + v * mesh->uv[index[2]] +
+    (1 - u - v) * mesh->uv[index[0]]);
+  interaction.brdf = material.get();
   interaction.type = Interaction::Type::GEOMETRY;
+}
 
-  return true;
+/**
+ * ray-mesh any-hit test, stops at the first triangle on the segment
+ * @param[in] ray the given ray
+ * @param[in] maxDist the end of the segment
+ * @return whether a triangle lies on the segment
+ */
+bool Mesh::occluded(const Ray &ray, Float maxDist) const {
+  TRAVERSAL_COUNT_TRIANGLES(mesh->nTriangles);
+  Ray segment = ray;
+  segment.tMax = std::min(maxDist, ray.tMax);
+  for (int i = 0; i < mesh->nTriangles; i++) {
+    Float t, u, v;
+    if (intersectTriangle(getVertex(i, 0), getVertex(i, 1), getVertex(i, 2),
+                          segment, t, u, v))
+      return true;
+  }
+  return false;
+}
+
+vec3 Mesh::getNormal() const {
+  const int *index = mesh->indices.data();
+  return (mesh->n[index[0]] + mesh->n[index[1]] + mesh->n[index[2]]) / 3;
 }
 
 /**
@@ -48,11 +109,34 @@ bool Triangle::intersect(Interaction &interaction, const Ray &ray) const {
  */
 void Geometry::setMaterial(std::shared_ptr<BRDF> newMat) { material = newMat; }
 
-Triangle::Triangle(std::shared_ptr<TriangleMesh> mesh, const int *v,
-                   std::shared_ptr<BRDF> mat)
-    : mesh(mesh), v(v) {
+bool Geometry::intersect(Interaction &interaction, const Ray &ray) const {
+  HitRecord hit;
+  if (!intersectHit(hit, ray)) return false;
+  resolveHit(interaction, hit, ray);
+  return true;
+}
+
+bool Geometry::occluded(const Ray &ray, Float maxDist) const {
+  Ray segment = ray;
+  segment.tMax = std::min(maxDist, ray.tMax);
+  HitRecord hit;
+  return intersectHit(hit, segment);
+}
+
+void Geometry::intersect(const RayPacket<RAY_PACKET_SIZE> &packet,
+                         HitPacket<RAY_PACKET_SIZE> &hits) const {
+  for (int i = 0; i < packet.size; i++) {
+    TRAVERSAL_SET_LANE(i);
+    hits.hit[i] = intersect(hits.interactions[i], packet.rays[i]);
+  }
+  TRAVERSAL_SET_LANE(0);
+}
+
+Mesh::Mesh(std::shared_ptr<TriangleMesh> mesh, std::shared_ptr<BRDF> mat)
+    : mesh(mesh), center(vec3::Zero()) {
   setMaterial(mat);
-  this->center = (mesh->p[v[0]] + mesh->p[v[1]] + mesh->p[v[2]])/3;
+  for (auto &p : mesh->p) center += p;
+  if (!mesh->p.empty()) center /= static_cast<Float>(mesh->p.size());
 }
 
 TriangleMesh::TriangleMesh(const std::vector<int> &indices, int nVertices,
@@ -78,14 +162,8 @@ std::vector<std::shared_ptr<Geometry>> makeTriangleMesh(
     const std::vector<int> &indices, int nVertices, const std::vector<vec3> &p,
     const std::vector<vec3> &n, const std::vector<vec2> &uv,
     const std::shared_ptr<BRDF> &mat) {
-  std::vector<std::shared_ptr<Geometry>> ret;
   auto mesh = std::make_shared<TriangleMesh>(indices, nVertices, p, n, uv);
-  ret.reserve(mesh->nTriangles);
-  for (int i = 0; i < mesh->nTriangles; ++i) {
-    ret.push_back(
-        std::make_shared<Triangle>(mesh, mesh->indices.data() + 3 * i, mat));
-  }
-  return ret;
+  return {std::make_shared<Mesh>(mesh, mat)};
 }
 
 std::vector<std::shared_ptr<Geometry>> makeParallelogram(
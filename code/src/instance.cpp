@@ -0,0 +1,316 @@
+#include <instance.h>
+#include <qbvh.h>
+#include <ray.h>
+#include <snapshot.h>
+#include <traversal_stats.h>
+#include <iostream>
+#include <unordered_map>
+
+namespace {
+
+// the object space box of geometry built as an Accel
+template <typename Accel>
+bool boundsOf(const Geometry &geom, AABB &bounds) {
+  auto accel = dynamic_cast<const Accel *>(&geom);
+  if (accel) bounds = accel->getBounds();
+  return accel != nullptr;
+}
+
+}  // namespace
+
+/**
+ * Instance class
+ */
+Instance::Instance(std::shared_ptr<Geometry> object, const AABB &objectBounds,
+                   const Matrix4x4 &objectToWorld)
+    : object(object) {
+  linear = objectToWorld.block<3, 3>(0, 0);
+  invLinear = linear.inverse();
+  translation = objectToWorld.block<3, 1>(0, 3);
+  identity = linear.isIdentity(0) && translation.isZero(0);
+  updateBounds(objectBounds);
+}
+
+void Instance::updateBounds(const AABB &objectBounds) {
+  // the world box encloses the 8 transformed corners of the object box
+  for (int i = 0; i < 8; i++) {
+    vec3 corner((i & 1) ? objectBounds.ub.x() : objectBounds.lb.x(),
+                (i & 2) ? objectBounds.ub.y() : objectBounds.lb.y(),
+                (i & 4) ? objectBounds.ub.z() : objectBounds.lb.z());
+    vec3 p = linear * corner + translation;
+    bounds = i == 0 ? AABB(p, p) : AABB(bounds, p);
+  }
+}
+
+Ray Instance::toObject(const Ray &ray) const {
+  Ray local = ray;
+  local.origin = invLinear * (ray.origin - translation);
+  local.direction = invLinear * ray.direction;
+  return local;
+}
+
+/**
+ * ray-instance intersect, the hit is found in object space
+ * @param[out] hit the hit in the object
+ * @param[in] ray the given ray
+ * @return whether ray hit the instance
+ */
+bool Instance::intersectHit(HitRecord &hit, const Ray &ray) const {
+  return object->intersectHit(hit, identity ? ray : toObject(ray));
+}
+
+/**
+ * the hit is resolved in object space, its position and normal are moved
+ * back to world space
+ */
+void Instance::resolveHit(Interaction &interaction, const HitRecord &hit,
+                          const Ray &ray) const {
+  if (identity) {
+    object->resolveHit(interaction, hit, ray);
+    return;
+  }
+  object->resolveHit(interaction, hit, toObject(ray));
+  interaction.entryPoint = ray.getPoint(interaction.entryDist);
+  interaction.normal = (invLinear.transpose() * interaction.normal).normalized();
+}
+
+bool Instance::occluded(const Ray &ray, Float maxDist) const {
+  if (identity) return object->occluded(ray, maxDist);
+  return object->occluded(toObject(ray), maxDist);
+}
+
+void Instance::save(SnapshotWriter &out) const {
+  // only objects built by KdTreeAccel can be stored
+  auto kdTree = std::dynamic_pointer_cast<KdTreeAccel>(object);
+  if (!kdTree) {
+    out.fail();
+    return;
+  }
+  int index;
+  bool first = out.addObject(object.get(), index);
+  out.write(index);
+  if (first) kdTree->save(out);
+  Matrix4x4 objectToWorld = Matrix4x4::Identity();
+  objectToWorld.block<3, 3>(0, 0) = linear;
+  objectToWorld.block<3, 1>(0, 3) = translation;
+  out.write(objectToWorld);
+}
+
+std::shared_ptr<Instance> Instance::load(SnapshotReader &in) {
+  int index = in.read<int>();
+  if (index == static_cast<int>(in.objects.size())) {
+    auto object = KdTreeAccel::load(in);
+    if (!object) return nullptr;
+    in.objects.push_back(object);
+  }
+  if (!in.ok() || index < 0 || index >= static_cast<int>(in.objects.size()))
+    return nullptr;
+  auto object = std::static_pointer_cast<KdTreeAccel>(in.objects[index]);
+  auto objectToWorld = in.read<Matrix4x4>();
+  if (!in.ok()) return nullptr;
+  return std::make_shared<Instance>(object, object->getBounds(), objectToWorld);
+}
+
+/**
+ * InstanceAccel class
+ */
+InstanceAccel::InstanceAccel(
+    const std::vector<std::shared_ptr<Instance>> &instances)
+    : instances(instances) {
+  build();
+}
+
+void InstanceAccel::build() {
+  auto start = std::chrono::high_resolution_clock::now();
+  nodes.clear();
+  instanceIndices.clear();
+  std::vector<AABB> bounds(instances.size());
+  for (int i = 0; i < static_cast<int>(instances.size()); i++) bounds[i] = instances[i]->getBounds();
+  KdTreeBuilder(bounds).build(nodes, instanceIndices);
+  stats.phaseTimes.clear();
+  stats.addPhase("build", start);
+  updateStats();
+  buildCost = stats.sahCost;
+}
+
+void InstanceAccel::updateStats() {
+  AccelStats shape = computeTreeStats(nodes);
+  shape.phaseTimes = std::move(stats.phaseTimes);
+  stats = std::move(shape);
+  stats.type = "instances";
+  stats.primitives = static_cast<int>(instances.size());
+  stats.memoryBytes = nodes.size() * sizeof(LinearKdTreeNode) + instanceIndices.size() * sizeof(int);
+}
+
+bool InstanceAccel::refit() {
+  std::unordered_map<const Geometry *, AABB> objectBounds;
+  for (auto &instance : instances) {
+    const auto &object = instance->getObject();
+    if (objectBounds.count(object.get())) continue;
+    auto kdTree = std::dynamic_pointer_cast<KdTreeAccel>(object);
+    if (!kdTree) return false;
+    kdTree->refit();
+    objectBounds.emplace(object.get(), kdTree->getBounds());
+  }
+  for (auto &instance : instances)
+    instance->updateBounds(objectBounds[instance->getObject().get()]);
+  if (nodes.empty()) return true;
+  for (auto &node : nodes) {
+    if (node.nPrimitives == 0) continue;
+    for (int i = 0; i < node.nPrimitives; i++) {
+      const AABB &box = instances[instanceIndices[node.primitivesOffset + i]]->getBounds();
+      node.box = i == 0 ? box : AABB(node.box, box);
+    }
+  }
+  refitInteriorNodes(nodes);
+  stats.sahCost = computeSahCost(nodes);
+  if (stats.sahCost > buildCost * REFIT_REBUILD_RATIO) build();
+  return true;
+}
+
+/**
+ * ray-accel intersect, same front to back traversal as KdTreeAccel
+ * @param[out] hit the closest hit, instanceId tells the instance
+ * @param[in] ray the given ray
+ * @return whether ray hit any instance
+ */
+bool InstanceAccel::intersectHit(HitRecord &hit, const Ray &ray) const {
+  if (nodes.empty()) return false;
+  Ray clipped = ray;
+  bool dirIsNeg[3] = {ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0};
+  bool found = false;
+  int nodesToVisit[64];
+  int toVisitOffset = 0;
+  int current = 0;
+  while (true) {
+    const LinearKdTreeNode &node = nodes[current];
+    Float tIn, tOut;
+    TRAVERSAL_COUNT_NODE();
+    if (node.box.rayIntersection(clipped, tIn, tOut) && tIn <= clipped.tMax) {
+      if (node.nPrimitives > 0) {
+        for (int i = 0; i < node.nPrimitives; i++) {
+          int index = instanceIndices[node.primitivesOffset + i];
+          // an instance only reports hits closer than clipped.tMax
+          if (instances[index]->intersectHit(hit, clipped)) {
+            clipped.tMax = hit.t;
+            hit.instanceId = index;
+            found = true;
+          }
+        }
+      } else if (dirIsNeg[node.axis]) {
+        nodesToVisit[toVisitOffset++] = current + 1;
+        current = node.secondChildOffset;
+        continue;
+      } else {
+        nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (toVisitOffset == 0) break;
+    current = nodesToVisit[--toVisitOffset];
+  }
+  return found;
+}
+
+void InstanceAccel::resolveHit(Interaction &interaction, const HitRecord &hit,
+                               const Ray &ray) const {
+  instances[hit.instanceId]->resolveHit(interaction, hit, ray);
+}
+
+bool InstanceAccel::occluded(const Ray &ray, Float maxDist) const {
+  if (nodes.empty()) return false;
+  maxDist = std::min(maxDist, ray.tMax);
+  bool dirIsNeg[3] = {ray.direction[0] < 0, ray.direction[1] < 0, ray.direction[2] < 0};
+  int nodesToVisit[64];
+  int toVisitOffset = 0;
+  int current = 0;
+  while (true) {
+    const LinearKdTreeNode &node = nodes[current];
+    Float tIn, tOut;
+    TRAVERSAL_COUNT_NODE();
+    if (node.box.rayIntersection(ray, tIn, tOut) && tIn <= maxDist) {
+      if (node.nPrimitives > 0) {
+        for (int i = 0; i < node.nPrimitives; i++) {
+          if (instances[instanceIndices[node.primitivesOffset + i]]->occluded(ray, maxDist))
+            return true;
+        }
+      } else if (dirIsNeg[node.axis]) {
+        nodesToVisit[toVisitOffset++] = current + 1;
+        current = node.secondChildOffset;
+        continue;
+      } else {
+        nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+        current = current + 1;
+        continue;
+      }
+    }
+    if (toVisitOffset == 0) break;
+    current = nodesToVisit[--toVisitOffset];
+  }
+  return false;
+}
+
+void InstanceAccel::save(SnapshotWriter &out) const {
+  out.write(static_cast<int>(instances.size()));
+  for (auto &instance : instances) instance->save(out);
+  out.writeArray(nodes);
+  out.writeArray(instanceIndices);
+}
+
+std::shared_ptr<InstanceAccel> InstanceAccel::load(SnapshotReader &in) {
+  std::shared_ptr<InstanceAccel> accel(new InstanceAccel());
+  int nInstances = in.read<int>();
+  for (int i = 0; i < nInstances && in.ok(); i++) {
+    auto instance = Instance::load(in);
+    if (!instance) return nullptr;
+    accel->instances.push_back(instance);
+  }
+  in.readArray(accel->nodes);
+  in.readArray(accel->instanceIndices);
+  if (!in.ok() || !isValidTree(accel->nodes, accel->instanceIndices.size(), 1)) return nullptr;
+  for (int index : accel->instanceIndices)
+    if (index < 0 || index >= static_cast<int>(accel->instances.size())) return nullptr;
+  accel->updateStats();
+  accel->buildCost = accel->stats.sahCost;
+  return accel;
+}
+
+std::shared_ptr<KdTreeAccel> makeInstanceObject(
+    const std::vector<std::shared_ptr<Geometry>> &mesh) {
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  meshes.reserve(mesh.size());
+  for (auto &geom : mesh) {
+    if (auto triangles = std::dynamic_pointer_cast<Mesh>(geom))
+      meshes.push_back(triangles);
+    else
+      std::clog << "Skipped a geometry of an instance object that is not a mesh" << std::endl;
+  }
+  return std::make_shared<KdTreeAccel>(MeshPrimitives(std::move(meshes)));
+}
+
+std::shared_ptr<Instance> makeIdentityInstance(const std::shared_ptr<Geometry> &object) {
+  // an InstanceAccel is left out, its hits would lose their inner instance
+  AABB bounds;
+  if (boundsOf<KdTreeAccel>(*object, bounds) || boundsOf<QBVHAccel>(*object, bounds) ||
+      boundsOf<OBVHAccel>(*object, bounds) || boundsOf<CompressedBVH8Accel>(*object, bounds) ||
+      boundsOf<CompressedBVH16Accel>(*object, bounds))
+    return std::make_shared<Instance>(object, bounds, Matrix4x4::Identity());
+  return nullptr;
+}
+
+std::shared_ptr<Instance> makeInstance(const std::shared_ptr<KdTreeAccel> &object,
+                                       const Matrix4x4 &objectToWorld) {
+  return std::make_shared<Instance>(object, object->getBounds(), objectToWorld);
+}
+
+std::shared_ptr<Instance> makeInstance(const std::shared_ptr<KdTreeAccel> &object,
+                                       Float scale, vec3 translation,
+                                       vec3 rotation_axis) {
+  Matrix3x3 rotation = Eigen::Quaternion<Float>::FromTwoVectors(vec3(0, 0, 1), rotation_axis)
+                           .toRotationMatrix();
+  Matrix4x4 objectToWorld = Matrix4x4::Identity();
+  objectToWorld.block<3, 3>(0, 0) = rotation * scale;
+  objectToWorld.block<3, 1>(0, 3) = translation;
+  return makeInstance(object, objectToWorld);
+}
@@ -1,6 +1,7 @@
 #include <integrator.h>
 #include <brdf.h>
 #include <light.h>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #define USE_DIRECTLIGHTING 1
@@ -10,6 +11,32 @@
  */
 Integrator::Integrator(std::shared_ptr<Camera> camera) : camera(camera) {}
 
+#ifdef ACCEL_TRAVERSAL_STATS
+void Integrator::resetTraversalCost() {
+  const vec2i &resolution = camera->getFilm().resolution;
+  nodeCost.assign(resolution.x() * resolution.y(), 0);
+  triangleCost.assign(nodeCost.size(), 0);
+}
+
+void Integrator::addTraversalCost(int dx, int dy, int lane, Float weight) {
+  int index = dy * camera->getFilm().resolution.x() + dx;
+  nodeCost[index] += traversalCounters().nodes[lane] * weight;
+  triangleCost[index] += traversalCounters().triangles[lane] * weight;
+}
+
+void Integrator::writeTraversalCost() const {
+  double nodes = 0, triangles = 0;
+  for (size_t i = 0; i < nodeCost.size(); i++) {
+    nodes += nodeCost[i];
+    triangles += triangleCost[i];
+  }
+  std::cout << "\nTraversal cost per camera ray: " << nodes / nodeCost.size() << " nodes, "
+            << triangles / triangleCost.size() << " triangles" << std::endl;
+  writeHeatmap(nodeCost, camera->getFilm().resolution, "traversal_nodes");
+  writeHeatmap(triangleCost, camera->getFilm().resolution, "traversal_triangles");
+}
+#endif
+
 /**
  * PhongLightingIntegrator class
  */
@@ -41,9 +68,12 @@ void PathIntegrator::render(Scene& scene) {
     samples[6] = rot_mtx * vec2(0.333, 0.333);
     samples[7] = rot_mtx * vec2(0.333, 0);
     samples[8] = rot_mtx * vec2(0.333, -0.333);
+#ifdef ACCEL_TRAVERSAL_STATS
+    resetTraversalCost();
+#endif
 
 #ifdef USE_OPENMP
-#pragma omp parallel for schedule(guided, 16) default(none) shared(now)
+#pragma omp parallel for schedule(guided, 16) shared(now)
 #endif
     for (int dx = 0; dx < camera->getFilm().resolution.x(); ++dx) {
 #ifdef USE_OPENMP
@@ -57,22 +87,36 @@ void PathIntegrator::render(Scene& scene) {
             // TODO: anti-aliasing
             //Ray ray = camera->generateRay(dx, dy);
             //L += radiance(scene, ray);
-            int sample_num = spp; //128
-            for (int i = 0; i < sample_num; i++)
+            // the spp * 9 primary rays of a pixel are coherent, trace them in packets
+            int sample_num = spp * static_cast<int>(samples.size());
+            RayPacket<RAY_PACKET_SIZE> packet;
+            HitPacket<RAY_PACKET_SIZE> hits;
+            for (int i = 0; i < sample_num; i += RAY_PACKET_SIZE)
             {
-              vec3 tempL = vec3(0, 0, 0);
-              for (auto& pos : samples)
+              packet.clear();
+              for (int j = i; j < std::min(sample_num, i + RAY_PACKET_SIZE); j++)
               {
-                Ray ray = camera->generateRay(pos[0] + dx, pos[1] + dy);
-                tempL += radiance(scene, ray);
+                auto& pos = samples[j % samples.size()];
+                packet.add(camera->generateRay(pos[0] + dx, pos[1] + dy));
               }
-              tempL = tempL / 9;
-              L += tempL;
+#ifdef ACCEL_TRAVERSAL_STATS
+              traversalCounters().reset();
+#endif
+              scene.intersect(packet, hits);
+#ifdef ACCEL_TRAVERSAL_STATS
+              for (int j = 0; j < packet.size; j++)
+                addTraversalCost(dx, dy, j, Float(1) / sample_num);
+#endif
+              for (int j = 0; j < packet.size; j++)
+                L += radiance(scene, packet.rays[j], hits.interactions[j], hits.hit[j]);
             }
             L = L / sample_num;
             camera->setPixel(dx, dy, L);
         }
     }
+#ifdef ACCEL_TRAVERSAL_STATS
+    writeTraversalCost();
+#endif
 }
 
 
@@ -83,14 +127,30 @@ void PathIntegrator::render(Scene& scene) {
  * @param[in] the given ray
  */
 vec3 PathIntegrator::radiance(Scene &scene, const Ray &ray) const {
+  Interaction interaction;
+  bool hit = scene.intersect(ray, interaction);
+  return radiance(scene, ray, interaction, hit);
+}
+
+/**
+ * calculate the radiance along a ray whose first intersection is known
+ * @param[in] scene the given scene
+ * @param[in] ray the given ray
+ * @param[in] interaction the first intersection of the ray
+ * @param[in] hit whether the ray hit the scene
+ */
+vec3 PathIntegrator::radiance(Scene &scene, const Ray &ray, Interaction &interaction, bool hit) const {
 
   vec3 L(0, 0, 0);
   Ray new_ray = ray;
   vec3 beta = vec3(1.0, 1.0, 1.0);
   int depth = max_depth;//8
   for (int i = 0; i < depth; i++) {
-    Interaction interaction;
-    if (scene.intersect(new_ray, interaction)) {
+    if (i > 0) {
+      interaction = Interaction();
+      hit = scene.intersect(new_ray, interaction);
+    }
+    if (hit) {
       if (interaction.type) {
         if (interaction.type == Interaction::GEOMETRY) {
           float pdf;
@@ -104,7 +164,9 @@ vec3 PathIntegrator::radiance(Scene &scene, const Ray &ray) const {
             new_ray.direction = interaction.wi;
             new_ray.origin = interaction.entryPoint + 0.0001 * interaction.normal;
             vec3 L_weighted = vec3(0, 0, 0), L2_wighted = vec3(0, 0, 0);
-            if (!scene.isShadowed(new_ray)) {
+            // only geometry between the point and the light sample blocks it
+            Float lightDist = (lightPos - new_ray.origin).norm();
+            if (!scene.occluded(new_ray, lightDist - SHADOW_EPS)) {
               vec3 tempL = interaction.brdf->eval(interaction).cwiseProduct(scene.getLight()->emission(lightPos, interaction.wi));
               tempL = tempL * interaction.normal.dot(interaction.wi) * vec3(0, -1, 0).dot(-interaction.wi) / pdf;           
               tempL = tempL / (lightPos - interaction.entryPoint).dot(lightPos - interaction.entryPoint);
@@ -170,37 +232,130 @@ void PhotonIntegrator::setRenderround(int round)
     render_round = round;
 }
 
-void PhotonIntegrator::buildKdPointTree(std::vector<std::shared_ptr<ViewPoint>> viewpoints)
+void PhotonIntegrator::buildKdPointTree(const std::vector<ViewPoint>& viewpoints)
 {
     this->kd_point_tree = std::make_shared<KdPointTree>(KdPointTree(viewpoints));
 }
 
+void PhotonIntegrator::mergeViewPoints()
+{
+    // the start of every column in view_points is the prefix sum of the sizes
+    column_offsets.assign(column_points.size() + 1, 0);
+    for (size_t i = 0; i < column_points.size(); i++)
+        column_offsets[i + 1] = column_offsets[i] + column_points[i].size();
+    view_points.resize(column_offsets.back());
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < static_cast<int>(column_points.size()); i++)
+        std::copy(column_points[i].begin(), column_points[i].end(), view_points.begin() + column_offsets[i]);
+}
 
+void PhotonIntegrator::gatherFlux()
+{
+    int film_y = camera->getFilm().resolution.y();
+    // the view points of a column all belong to pixels of that column, so
+    // columns are reduced in parallel without races
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int dx = 0; dx < (int)column_offsets.size() - 1; dx++)
+    {
+        for (size_t i = column_offsets[dx]; i < column_offsets[dx + 1]; i++)
+            pixels_data[dx * film_y + view_points[i].y] += view_points[i].flux;
+    }
+}
 
+void PhotonIntegrator::setHashGrid(bool enable)
+{
+    use_hash_grid = enable;
+}
 
+void PhotonIntegrator::setProgressive(bool enable, Float alpha)
+{
+    progressive = enable;
+    this->alpha = alpha;
+}
 
+Float PhotonIntegrator::assignPixelRadii()
+{
+    int film_y = camera->getFilm().resolution.y();
+    Float max_radius2 = 0;
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static) reduction(max : max_radius2)
+#endif
+    for (int i = 0; i < static_cast<int>(view_points.size()); i++)
+    {
+        ViewPoint& v = view_points[i];
+        v.radius2 = pixel_stats[v.x * film_y + v.y].radius2;
+        max_radius2 = std::max(max_radius2, v.radius2);
+    }
+    return std::sqrt(max_radius2);
+}
 
-vec3 PhotonIntegrator::RayTracing(Scene& scene, const Ray& ray, double strength, int x, int y, int depth = 0, const vec3 color = vec3(1.0,1.0,1.0))
+void PhotonIntegrator::updatePixelStatistics()
+{
+    int film_y = camera->getFilm().resolution.y();
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int dx = 0; dx < (int)column_offsets.size() - 1; dx++)
+    {
+        // photons M and flux of the round of every pixel in the column
+        std::vector<Float> photons(film_y, 0);
+        std::vector<vec3> flux(film_y, vec3::Zero());
+        for (size_t i = column_offsets[dx]; i < column_offsets[dx + 1]; i++)
+        {
+            photons[view_points[i].y] += view_points[i].photons;
+            flux[view_points[i].y] += view_points[i].flux;
+        }
+        for (int dy = 0; dy < film_y; dy++)
+        {
+            PixelStatistics& stats = pixel_stats[dx * film_y + dy];
+            stats.direct += pixels_data[dx * film_y + dy];
+            if (photons[dy] <= 0) continue;
+            // keep a fraction alpha of the new photons and shrink the disc so
+            // that the photon density stays the same
+            Float n = stats.photons + alpha * photons[dy];
+            Float radius2 = stats.radius2 * n / (stats.photons + photons[dy]);
+            stats.tau = (stats.tau + flux[dy]) * (radius2 / stats.radius2);
+            stats.photons = n;
+            stats.radius2 = radius2;
+        }
+    }
+}
+
+
+
+
+
+
+vec3 PhotonIntegrator::RayTracing(Scene& scene, const Ray& ray, std::vector<ViewPoint>& points, double strength, int x, int y, int depth = 0, const vec3 color = vec3(1.0,1.0,1.0))
 {
   if (depth >= bounceMaxDepth) return vec3(0, 0, 0);
-  Ray new_ray = ray;
   Interaction interaction;
-  if (scene.intersect(new_ray, interaction)) {
+  bool hit = scene.intersect(ray, interaction);
+  return RayTracing(scene, ray, interaction, hit, points, strength, x, y, depth, color);
+}
+
+vec3 PhotonIntegrator::RayTracing(Scene& scene, const Ray& ray, Interaction& interaction, bool hit, std::vector<ViewPoint>& points, double strength, int x, int y, int depth, const vec3 color)
+{
+  if (depth >= bounceMaxDepth) return vec3(0, 0, 0);
+  Ray new_ray = ray;
+  if (hit) {
     if (interaction.type) {
       interaction.wo = -new_ray.direction;
       if (interaction.type == Interaction::GEOMETRY) {
         if (strcmp(interaction.brdf->getName(), "IdealDiffusion") == 0)
         {
-          std::shared_ptr<ViewPoint> new_point(new ViewPoint(interaction.entryPoint, interaction.normal, color.cwiseProduct(interaction.brdf->eval(interaction)), strength, x, y));
-#pragma omp critical
-          view_points.push_back(new_point);
+          points.emplace_back(interaction.entryPoint, interaction.normal, color.cwiseProduct(interaction.brdf->eval(interaction)), strength, x, y);
         }
         else
         {
           Float pdf = interaction.brdf->sample(interaction);
           new_ray.direction = interaction.wi;
           new_ray.origin = interaction.entryPoint + 0.0001 * new_ray.direction;
-          return RayTracing(scene, new_ray, strength, x, y, depth + 1, color.cwiseProduct(interaction.brdf->eval(interaction)));
+          return RayTracing(scene, new_ray, points, strength, x, y, depth + 1, color.cwiseProduct(interaction.brdf->eval(interaction)));
         }
       }
       else if (interaction.type == Interaction::LIGHT) {
@@ -230,17 +385,52 @@ void PhotonIntegrator::PhotonTracing(Scene& scene, const Ray& ray, const int dep
   }
   else
   {
-    std::vector<std::shared_ptr<ViewPoint>> tmpViewPoint;
-    kd_point_tree->search(tmpViewPoint, interact.entryPoint, current_radius);
-    for (auto& v : tmpViewPoint) {
-      if (v->N.dot(ray.direction) < 0)
+    auto deposit = [&](ViewPoint& v) {
+      if (progressive)
+      {
+        // the search used the largest radius, every pixel has its own
+        if (v.N.dot(ray.direction) >= 0 || (v.C - interact.entryPoint).squaredNorm() >= v.radius2) return;
+        vec3 phi = v.color.cwiseProduct(radi).cwiseMax(vec3::Zero()) * v.strength;
+        for (int c = 0; c < 3; c++)
+        {
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+          v.flux[c] += phi[c];
+        }
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+        v.photons += v.strength;
+        return;
+      }
+      if (v.N.dot(ray.direction) < 0)
       {
         Float r = current_radius;
-        vec3 res = v->color.cwiseProduct(radi).cwiseMax(vec3::Zero()) / (PI * r * r) * v->strength;
-#pragma omp critical
-        pixels_data[v->x * camera->getFilm().resolution.y() + v->y] += res;
-
+        vec3 res = v.color.cwiseProduct(radi).cwiseMax(vec3::Zero()) / (PI * r * r) * v.strength;
+        // photons rarely meet the same view point at once, atomic adds
+        // instead of a lock keep the threads from queueing
+        for (int c = 0; c < 3; c++)
+        {
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+          v.flux[c] += res[c];
+        }
       }
+    };
+    if (use_hash_grid) {
+      thread_local std::vector<int> nearPoints;
+      nearPoints.clear();
+      view_point_grid.search(nearPoints, interact.entryPoint, current_radius);
+      for (int i : nearPoints)
+        deposit(view_points[i]);
+    }
+    else {
+      std::vector<const ViewPoint*> tmpViewPoint;
+      kd_point_tree->search(tmpViewPoint, interact.entryPoint, current_radius);
+      for (auto v : tmpViewPoint)
+        deposit(view_points[v - view_points.data()]);
     }
     float pdf = interact.brdf->sample(interact);
     Ray newray = Ray(interact.entryPoint + 0.0000001 * interact.wi, interact.wi);
@@ -254,12 +444,19 @@ void PhotonIntegrator::PhotonTracing(Scene& scene, const Ray& ray, const int dep
 
 void PhotonIntegrator::render(Scene& scene) {
     //initialize for render process
-    scene.buildAccel();
+    if (!scene.isAccelBuilt()) scene.buildAccel();
     int now = 0;
     int film_x = camera->getFilm().resolution.x();
     int film_y = camera->getFilm().resolution.y();
 
     pixels_data.resize(film_x * film_y);//initialize pixels data
+    column_points.resize(film_x);
+    if (progressive)
+    {
+        PixelStatistics initial;
+        initial.radius2 = initial_radius * initial_radius;
+        pixel_stats.assign(film_x * film_y, initial);
+    }
     
     Float current_radius = initial_radius; //initialize radius for photon_tracing
     //Float current_energy = 1.0f / log(render_round); //initialize energy for photon tracing
@@ -273,6 +470,9 @@ void PhotonIntegrator::render(Scene& scene) {
         }
     }
 
+#ifdef ACCEL_TRAVERSAL_STATS
+    resetTraversalCost();
+#endif
     // start rendering
     for (int iter = 0; iter < render_round; iter++)
     {
@@ -283,7 +483,7 @@ void PhotonIntegrator::render(Scene& scene) {
         
 
 #ifdef USE_OPENMP
-#pragma omp parallel for schedule(guided, 16) default(none) shared(now)
+#pragma omp parallel for schedule(guided, 16) shared(now)
 #endif
         for (int dx = 0; dx < camera->getFilm().resolution.x(); ++dx)
         {
@@ -291,32 +491,65 @@ void PhotonIntegrator::render(Scene& scene) {
 #pragma omp atomic
 #endif
             ++now;
+            // every column collects its view points alone, no lock is needed
+            std::vector<ViewPoint>& points = column_points[dx];
+            points.clear();
             printf("\r%.02f%%", now * 100.0 / camera->getFilm().resolution.x());
-            for (int dy = 0; dy < camera->getFilm().resolution.y(); ++dy)
+            // camera rays of neighbouring pixels in a column are traced in packets
+            std::vector<vec3> column(film_y, vec3::Zero());
+            RayPacket<RAY_PACKET_SIZE> packet;
+            HitPacket<RAY_PACKET_SIZE> hits;
+            int sample_num = film_y * this->spp;
+            for (int i = 0; i < sample_num; i += RAY_PACKET_SIZE)
             {
-              vec3 L = vec3(0, 0, 0);
-                for (int i = 0; i < this->spp; i++)
+                packet.clear();
+                for (int j = i; j < std::min(sample_num, i + RAY_PACKET_SIZE); j++)
                 {
+                    int dy = j / this->spp;
                     Float _dx = dx + (unif(0.0, 1.0, 1)[0] * 1.0 - .5) * 1;
                     Float _dy = dy + (unif(0.0, 1.0, 1)[0] * 1.0 - .5) * 1; // add random interruption every round
-                    Ray cam_ray = camera->generateRay(_dx, _dy);
-                    L += RayTracing(scene, cam_ray, current_energy/this->spp, dx, dy);
+                    packet.add(camera->generateRay(_dx, _dy));
+                }
+#ifdef ACCEL_TRAVERSAL_STATS
+                traversalCounters().reset();
+#endif
+                scene.intersect(packet, hits);
+#ifdef ACCEL_TRAVERSAL_STATS
+                for (int j = 0; j < packet.size; j++)
+                    addTraversalCost(dx, (i + j) / this->spp, j, Float(1) / (this->spp * render_round));
+#endif
+                for (int j = 0; j < packet.size; j++)
+                {
+                    int dy = (i + j) / this->spp;
+                    // progressive mode weights the rounds equally when it updates the film
+                    column[dy] += RayTracing(scene, packet.rays[j], hits.interactions[j], hits.hit[j], points,
+                        (progressive ? 1 : current_energy) / this->spp, dx, dy, 0, vec3(1.0, 1.0, 1.0));
                 }
+            }
+            for (int dy = 0; dy < film_y; ++dy)
+            {
+                vec3 L = column[dy];
                 if (L != vec3(0, 0, 0))
                 {
-                    pixels_data[dx * camera->getFilm().resolution.y() + dy] = L / spp;
+                    // camera samples are already weighted by 1 / spp in progressive mode
+                    pixels_data[dx * camera->getFilm().resolution.y() + dy] = progressive ? L : L / spp;
                 }
 
             }
         }
-        buildKdPointTree(view_points);
+        mergeViewPoints();
+        Float search_radius = progressive ? assignPixelRadii() : current_radius;
+        if (use_hash_grid)
+            view_point_grid = ViewPointGrid(view_points, search_radius);
+        else
+            buildKdPointTree(view_points);
         printf("\nPhoton rendering...");
 
         int photon_now = 0;
         if (scene.getLights().empty())
         {
 #ifdef USE_OPENMP
-#pragma omp parallel for schedule(guided, 16) default(none) shared(photon_now)
+#pragma omp parallel for schedule(guided, 16) shared(photon_now)
 #endif
             for (int i = 0; i < photon_num; i++)
             {
@@ -325,7 +558,7 @@ void PhotonIntegrator::render(Scene& scene) {
                 Ray light_ray = scene.getLight()->generateRay(light_energy); // randomly generate a ray from light
                 vec3 radi = light_energy / photon_num;
                 //vec3 radi = scene.getLight()->getRadiance()/ photon_num;
-                PhotonTracing(scene, light_ray, 1, radi, current_radius); // todo
+                PhotonTracing(scene, light_ray, 1, radi, search_radius); // todo
 #ifdef USE_OPENMP
 #pragma omp atomic
 #endif
@@ -338,7 +571,7 @@ void PhotonIntegrator::render(Scene& scene) {
             for (auto& lt : scene.getLights())
             {
 #ifdef USE_OPENMP
-#pragma omp parallel for schedule(guided, 16) default(none) shared(photon_now)
+#pragma omp parallel for schedule(guided, 16) shared(photon_now)
 #endif
                 for (int i = 0; i < light_emit_num; i++)
                 {
@@ -347,7 +580,7 @@ void PhotonIntegrator::render(Scene& scene) {
                     Ray light_ray = lt->generateRay(light_energy); // randomly generate a ray from light
                     vec3 radi = light_energy / photon_num;
                     //vec3 radi = scene.getLight()->getRadiance()/ photon_num;
-                    PhotonTracing(scene, light_ray, 1, radi, current_radius); // todo
+                    PhotonTracing(scene, light_ray, 1, radi, search_radius); // todo
 #ifdef USE_OPENMP
 #pragma omp atomic
 #endif
@@ -355,14 +588,28 @@ void PhotonIntegrator::render(Scene& scene) {
                 }
             }
         }
-
-
-
-        for (int dx = 0; dx < camera->getFilm().resolution.x(); ++dx)
+        if (progressive)
+        {
+            updatePixelStatistics();
+            // the estimate of every pixel after iter + 1 rounds of photons
+            for (int dx = 0; dx < film_x; ++dx)
+            {
+                for (int dy = 0; dy < film_y; ++dy)
+                {
+                    const PixelStatistics& stats = pixel_stats[dx * film_y + dy];
+                    camera->setPixel(dx, dy, (stats.direct + stats.tau / (PI * stats.radius2)) / (iter + 1));
+                }
+            }
+        }
+        else
         {
-            for (int dy = 0; dy < camera->getFilm().resolution.y(); ++dy)
+            gatherFlux();
+            for (int dx = 0; dx < camera->getFilm().resolution.x(); ++dx)
             {
-                camera->updatePixel(dx, dy, pixels_data[dx * film_y + dy]); //update pixel every time
+                for (int dy = 0; dy < camera->getFilm().resolution.y(); ++dy)
+                {
+                    camera->updatePixel(dx, dy, pixels_data[dx * film_y + dy]); //update pixel every time
+                }
             }
         }
         std::string file_name = "output_round";
@@ -379,7 +626,178 @@ void PhotonIntegrator::render(Scene& scene) {
         std::cout
             << "\nRound " << iter << " takes " << timeElapsed << " ms" << std::endl;
     }
+#ifdef ACCEL_TRAVERSAL_STATS
+    writeTraversalCost();
+#endif
+
+}
+
+/// <summary>
+/// Integrator for two-pass photon mapping
+/// </summary>
+
+PhotonMapIntegrator::PhotonMapIntegrator(std::shared_ptr<Camera> camera, int photon_num, int k, Float max_radius,
+    int max_depth, int spp)
+    : Integrator(camera), photon_num(photon_num), k(k), max_radius(max_radius), max_depth(max_depth), spp(spp) {}
+
+void PhotonMapIntegrator::buildPhotonMap(Scene& scene)
+{
+    if (!scene.isAccelBuilt()) scene.buildAccel();
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::shared_ptr<Light>> lights = scene.getLights();
+    if (lights.empty()) lights.push_back(scene.getLight());
+    // every chunk of photons stores into its own buffer, the buffers are
+    // concatenated in chunk order afterwards
+    int chunk_num = (photon_num + PHOTON_TRACE_CHUNK_SIZE - 1) / PHOTON_TRACE_CHUNK_SIZE;
+    std::vector<std::vector<Photon>> chunks(chunk_num);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int c = 0; c < chunk_num; c++)
+    {
+        for (int i = c * PHOTON_TRACE_CHUNK_SIZE; i < std::min(photon_num, (c + 1) * PHOTON_TRACE_CHUNK_SIZE); i++)
+        {
+            vec3 light_energy;
+            Ray light_ray = lights[i % lights.size()]->generateRay(light_energy);
+            tracePhoton(scene, light_ray, 1, light_energy / photon_num, chunks[c]);
+        }
+    }
+    std::vector<Photon> photons;
+    for (auto& chunk : chunks)
+        photons.insert(photons.end(), chunk.begin(), chunk.end());
+    photon_map = std::make_shared<PhotonMap>(std::move(photons));
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Photon map of " << photon_map->size() << " photons takes "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms" << std::endl;
+}
+
+void PhotonMapIntegrator::tracePhoton(Scene& scene, const Ray& ray, int depth, const vec3& power,
+    std::vector<Photon>& photons) const
+{
+    if (depth > max_depth) return;
+    Interaction interact;
+    scene.intersect(ray, interact);
+    if (interact.type != Interaction::GEOMETRY) return;
+    interact.wo = -ray.direction;
+    vec3 next = power;
+    if (strcmp(interact.brdf->getName(), "IdealDiffusion") != 0)
+    {
+        interact.brdf->sample(interact);
+        next = interact.brdf->eval(interact).cwiseProduct(power).cwiseMax(vec3::Zero());
+    }
+    else
+    {
+        Photon photon;
+        photon.position = interact.entryPoint;
+        photon.power = power;
+        photon.direction = ray.direction;
+        photons.push_back(photon);
+        interact.brdf->sample(interact);
+        next = interact.brdf->eval(interact).cwiseProduct(power).cwiseMax(vec3::Zero()) * PI;
+    }
+    Ray newray = Ray(interact.entryPoint + 0.0001 * interact.wi, interact.wi);
+    tracePhoton(scene, newray, depth + 1, next, photons);
+}
+
+vec3 PhotonMapIntegrator::estimate(const Interaction& interaction, const vec3& weight) const
+{
+    thread_local std::vector<NearPhoton> nearest;
+    // photons arriving at the back of the surface belong to another one, the
+    // search skips them so that the radius only spans photons that count
+    Float radius2 = photon_map->nearest(nearest, interaction.entryPoint, k, max_radius * max_radius,
+        &interaction.normal);
+    vec3 flux = vec3::Zero();
+    for (auto& near : nearest)
+        flux += photon_map->getPhoton(near.index).power;
+    if (radius2 <= 0) return vec3::Zero();
+    return weight.cwiseProduct(flux) / (PI * radius2);
+}
+
+void PhotonMapIntegrator::render(Scene& scene)
+{
+    if (!scene.isAccelBuilt()) scene.buildAccel();
+    if (!photon_map) buildPhotonMap(scene);
+    int now = 0;
+    int film_y = camera->getFilm().resolution.y();
+#ifdef ACCEL_TRAVERSAL_STATS
+    resetTraversalCost();
+#endif
+
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(guided, 16) shared(now)
+#endif
+    for (int dx = 0; dx < camera->getFilm().resolution.x(); ++dx)
+    {
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+        ++now;
+        printf("\r%.02f%%", now * 100.0 / camera->getFilm().resolution.x());
+        // camera rays of neighbouring pixels in a column are traced in packets
+        std::vector<vec3> column(film_y, vec3::Zero());
+        RayPacket<RAY_PACKET_SIZE> packet;
+        HitPacket<RAY_PACKET_SIZE> hits;
+        int sample_num = film_y * spp;
+        for (int i = 0; i < sample_num; i += RAY_PACKET_SIZE)
+        {
+            packet.clear();
+            for (int j = i; j < std::min(sample_num, i + RAY_PACKET_SIZE); j++)
+            {
+                int dy = j / spp;
+                Float _dx = dx + (unif(0.0, 1.0, 1)[0] - .5);
+                Float _dy = dy + (unif(0.0, 1.0, 1)[0] - .5);
+                packet.add(camera->generateRay(_dx, _dy));
+            }
+#ifdef ACCEL_TRAVERSAL_STATS
+            traversalCounters().reset();
+#endif
+            scene.intersect(packet, hits);
+#ifdef ACCEL_TRAVERSAL_STATS
+            for (int j = 0; j < packet.size; j++)
+                addTraversalCost(dx, (i + j) / spp, j, Float(1) / spp);
+#endif
+            for (int j = 0; j < packet.size; j++)
+                column[(i + j) / spp] += radiance(scene, packet.rays[j], hits.interactions[j], hits.hit[j]);
+        }
+        for (int dy = 0; dy < film_y; ++dy)
+            camera->setPixel(dx, dy, column[dy] / spp);
+    }
+#ifdef ACCEL_TRAVERSAL_STATS
+    writeTraversalCost();
+#endif
+}
 
+vec3 PhotonMapIntegrator::radiance(Scene& scene, const Ray& ray) const
+{
+    Interaction interaction;
+    bool hit = scene.intersect(ray, interaction);
+    return radiance(scene, ray, interaction, hit);
+}
+
+vec3 PhotonMapIntegrator::radiance(Scene& scene, const Ray& ray, Interaction& interaction, bool hit) const
+{
+    Ray new_ray = ray;
+    vec3 beta = vec3(1.0, 1.0, 1.0);
+    for (int depth = 0; depth < max_depth; depth++)
+    {
+        if (depth > 0)
+        {
+            interaction = Interaction();
+            hit = scene.intersect(new_ray, interaction);
+        }
+        if (!hit || interaction.type == Interaction::NONE) break;
+        if (interaction.type == Interaction::LIGHT)
+            return beta.cwiseProduct(interaction.emission);
+        interaction.wo = -new_ray.direction;
+        if (strcmp(interaction.brdf->getName(), "IdealDiffusion") == 0)
+            return estimate(interaction, beta.cwiseProduct(interaction.brdf->eval(interaction)));
+        // specular surfaces are followed until a diffuse one is met
+        interaction.brdf->sample(interaction);
+        beta = beta.cwiseProduct(interaction.brdf->eval(interaction));
+        new_ray.direction = interaction.wi;
+        new_ray.origin = interaction.entryPoint + 0.0001 * new_ray.direction;
+    }
+    return vec3::Zero();
 }
 
 
@@ -400,3 +818,7 @@ std::shared_ptr<Integrator> makePhotonIntegrator(std::shared_ptr<Camera> camera,
     return std::make_shared<PhotonIntegrator>(camera, render_round, photon_num, initial_radius, re_decay, bouncemaxdepth, max_depth, spp);
 }
 
+std::shared_ptr<Integrator> makePhotonMapIntegrator(std::shared_ptr<Camera> camera, int photon_num, int k,
+        Float max_radius, int max_depth, int spp) {
+    return std::make_shared<PhotonMapIntegrator>(camera, photon_num, k, max_radius, max_depth, spp);
+}
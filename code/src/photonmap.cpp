@@ -0,0 +1,62 @@
+#include <photonmap.h>
+#include <algorithm>
+
+PhotonMap::PhotonMap(std::vector<Photon> photons)
+  : photons(std::move(photons))
+{
+  balance(0, static_cast<int>(this->photons.size()));
+}
+
+void PhotonMap::balance(int lo, int hi)
+{
+  if (hi - lo <= 1) return;
+  vec3 lb = photons[lo].position, ub = lb;
+  for (int i = lo + 1; i < hi; i++) {
+    lb = lb.cwiseMin(photons[i].position);
+    ub = ub.cwiseMax(photons[i].position);
+  }
+  int axis;
+  (ub - lb).maxCoeff(&axis);
+  int mid = (lo + hi) / 2;
+  std::nth_element(photons.begin() + lo, photons.begin() + mid, photons.begin() + hi,
+                   [axis](const Photon& a, const Photon& b) { return a.position[axis] < b.position[axis]; });
+  photons[mid].axis = static_cast<uint8_t>(axis);
+  balance(lo, mid);
+  balance(mid + 1, hi);
+}
+
+Float PhotonMap::nearest(std::vector<NearPhoton>& result, const vec3& pos, int k, Float maxDist2,
+                         const vec3* normal) const
+{
+  result.clear();
+  if (k <= 0) return maxDist2;
+  nearest(0, static_cast<int>(photons.size()), result, pos, k, maxDist2, normal);
+  return maxDist2;
+}
+
+void PhotonMap::nearest(int lo, int hi, std::vector<NearPhoton>& result, const vec3& pos, int k,
+                        Float& maxDist2, const vec3* normal) const
+{
+  if (lo >= hi) return;
+  int mid = (lo + hi) / 2;
+  const Photon& photon = photons[mid];
+  Float delta = pos[photon.axis] - photon.position[photon.axis];
+  // the side of the splitting plane holding pos first, its photons are closer
+  if (delta < 0) nearest(lo, mid, result, pos, k, maxDist2, normal);
+  else nearest(mid + 1, hi, result, pos, k, maxDist2, normal);
+  if (delta * delta >= maxDist2) return;
+
+  Float dist2 = (photon.position - pos).squaredNorm();
+  if (dist2 < maxDist2 && (!normal || photon.direction.dot(*normal) < 0)) {
+    // a bounded max-heap: once it holds k photons the farthest is replaced
+    if (result.size() == static_cast<size_t>(k)) {
+      std::pop_heap(result.begin(), result.end());
+      result.pop_back();
+    }
+    result.push_back({dist2, mid});
+    std::push_heap(result.begin(), result.end());
+    if (result.size() == static_cast<size_t>(k)) maxDist2 = result.front().dist2;
+  }
+  if (delta < 0) nearest(mid + 1, hi, result, pos, k, maxDist2, normal);
+  else nearest(lo, mid, result, pos, k, maxDist2, normal);
+}
@@ -0,0 +1,582 @@
+#include <qbvh.h>
+#include <ray.h>
+#include <geometry.h>
+#include <traversal_stats.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+/**
+ * Per-ray data shared by every slab test of a traversal
+ */
+struct WideRay {
+  Float origin[3];
+  Float invDir[3];
+  int dirIsNeg[3];
+};
+
+/**
+ * slab test of the ray against all children of a node
+ * @param[in] node the wide node
+ * @param[in] ray the precomputed ray
+ * @param[in] tMin, tMax the current ray segment
+ * @param[out] tNear entry distance of every child
+ * @return bit i is set if the ray hits child i
+ */
+template <int Width>
+inline int intersectChildren(const WideBVHNode<Width> &node, const WideRay &ray,
+                             Float tMin, Float tMax, Float *tNear) {
+  // the near plane along an axis is the upper bound if the ray goes backwards
+  const Float *nearX = node.bounds[ray.dirIsNeg[0]][0];
+  const Float *nearY = node.bounds[ray.dirIsNeg[1]][1];
+  const Float *nearZ = node.bounds[ray.dirIsNeg[2]][2];
+  const Float *farX = node.bounds[1 - ray.dirIsNeg[0]][0];
+  const Float *farY = node.bounds[1 - ray.dirIsNeg[1]][1];
+  const Float *farZ = node.bounds[1 - ray.dirIsNeg[2]][2];
+  int mask = 0;
+#if defined(ACCEL_USE_AVX)
+  if constexpr (Width == 8) {
+    const __m256 ox = _mm256_set1_ps(ray.origin[0]), oy = _mm256_set1_ps(ray.origin[1]),
+                 oz = _mm256_set1_ps(ray.origin[2]);
+    const __m256 ix = _mm256_set1_ps(ray.invDir[0]), iy = _mm256_set1_ps(ray.invDir[1]),
+                 iz = _mm256_set1_ps(ray.invDir[2]);
+    __m256 t0 = _mm256_max_ps(
+        _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), ox), ix),
+                      _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), oy), iy)),
+        _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), oz), iz),
+                      _mm256_set1_ps(tMin)));
+    __m256 t1 = _mm256_min_ps(
+        _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), ox), ix),
+                      _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), oy), iy)),
+        _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), oz), iz),
+                      _mm256_set1_ps(tMax)));
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+  }
+#endif
+#if defined(ACCEL_USE_SSE)
+  const __m128 ox = _mm_set1_ps(ray.origin[0]), oy = _mm_set1_ps(ray.origin[1]),
+               oz = _mm_set1_ps(ray.origin[2]);
+  const __m128 ix = _mm_set1_ps(ray.invDir[0]), iy = _mm_set1_ps(ray.invDir[1]),
+               iz = _mm_set1_ps(ray.invDir[2]);
+  const __m128 vMin = _mm_set1_ps(tMin), vMax = _mm_set1_ps(tMax);
+  for (int c = 0; c < Width; c += 4) {
+    __m128 t0 = _mm_max_ps(
+        _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX + c), ox), ix),
+                   _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY + c), oy), iy)),
+        _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ + c), oz), iz), vMin));
+    __m128 t1 = _mm_min_ps(
+        _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX + c), ox), ix),
+                   _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY + c), oy), iy)),
+        _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ + c), oz), iz), vMax));
+    _mm_storeu_ps(tNear + c, t0);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << c;
+  }
+#else
+  for (int c = 0; c < Width; c++) {
+    Float t0 = std::max(std::max((nearX[c] - ray.origin[0]) * ray.invDir[0],
+                                 (nearY[c] - ray.origin[1]) * ray.invDir[1]),
+                        std::max((nearZ[c] - ray.origin[2]) * ray.invDir[2], tMin));
+    Float t1 = std::min(std::min((farX[c] - ray.origin[0]) * ray.invDir[0],
+                                 (farY[c] - ray.origin[1]) * ray.invDir[1]),
+                        std::min((farZ[c] - ray.origin[2]) * ray.invDir[2], tMax));
+    tNear[c] = t0;
+    if (t0 <= t1) mask |= 1 << c;
+  }
+#endif
+  return mask;
+}
+
+/**
+ * collapse a binary subtree into Width-wide nodes
+ * @param[in] binaryNodes the binary tree, leaves keep their primitivesOffset
+ * @param[in] index root of the subtree
+ * @param[out] nodes the wide nodes are appended here
+ * @return index of the wide node of the subtree
+ */
+template <int Width>
+int collapse(const std::vector<LinearKdTreeNode> &binaryNodes, int index,
+             std::vector<WideBVHNode<Width>> &nodes) {
+  // gather up to Width descendants, always opening the largest interior one
+  std::vector<int> children;
+  const LinearKdTreeNode &node = binaryNodes[index];
+  if (node.nPrimitives > 0) {
+    children.push_back(index);
+  } else {
+    children.push_back(index + 1);
+    children.push_back(node.secondChildOffset);
+  }
+  while (children.size() < Width) {
+    int best = -1;
+    Float bestArea = -1;
+    for (int i = 0; i < static_cast<int>(children.size()); i++) {
+      const LinearKdTreeNode &child = binaryNodes[children[i]];
+      if (child.nPrimitives == 0 && child.box.surfaceArea() > bestArea) {
+        best = i;
+        bestArea = child.box.surfaceArea();
+      }
+    }
+    if (best == -1) break;
+    int opened = children[best];
+    children[best] = opened + 1;
+    children.push_back(binaryNodes[opened].secondChildOffset);
+  }
+
+  int offset = static_cast<int>(nodes.size());
+  nodes.emplace_back();
+  for (int i = 0; i < Width; i++) {
+    WideBVHNode<Width> &wide = nodes[offset];
+    if (i >= static_cast<int>(children.size())) {
+      // empty slot, its box can never be hit
+      for (int a = 0; a < 3; a++) {
+        wide.bounds[0][a][i] = INF;
+        wide.bounds[1][a][i] = -INF;
+      }
+      wide.child[i] = -1;
+      wide.count[i] = 0;
+      continue;
+    }
+    const LinearKdTreeNode &child = binaryNodes[children[i]];
+    for (int a = 0; a < 3; a++) {
+      wide.bounds[0][a][i] = child.box.lb[a];
+      wide.bounds[1][a][i] = child.box.ub[a];
+    }
+    if (child.nPrimitives > 0) {
+      wide.child[i] = child.primitivesOffset;
+      wide.count[i] = child.nPrimitives;
+    } else {
+      // nodes may be reallocated by the recursion, write through the index
+      int childOffset = collapse(binaryNodes, children[i], nodes);
+      nodes[offset].child[i] = childOffset;
+      nodes[offset].count[i] = 0;
+    }
+  }
+  return offset;
+}
+
+/**
+ * gather the shape of a wide subtree into stats
+ * @param[in] nodes the wide nodes
+ * @param[in] index the root of the subtree
+ * @param[in] depth depth of the root
+ * @param[out] stats leaves are counted here
+ * @return SAH cost of the children of the subtree, not divided by any area
+ */
+template <int Width>
+Float collectWideStats(const std::vector<WideBVHNode<Width>> &nodes, int index, int depth,
+                       AccelStats &stats) {
+  const WideBVHNode<Width> &node = nodes[index];
+  Float cost = 0;
+  for (int c = 0; c < Width; c++) {
+    if (node.child[c] < 0) continue;
+    AABB box(node.bounds[0][0][c], node.bounds[0][1][c], node.bounds[0][2][c],
+             node.bounds[1][0][c], node.bounds[1][1][c], node.bounds[1][2][c]);
+    if (node.count[c] > 0) {
+      stats.addLeaf(node.count[c], depth + 1);
+      cost += SAH_INTERSECT_COST * node.count[c] * box.surfaceArea();
+    } else {
+      cost += SAH_TRAVERSAL_COST * box.surfaceArea() +
+              collectWideStats(nodes, node.child[c], depth + 1, stats);
+    }
+  }
+  return cost;
+}
+
+/* Shape and SAH cost of a wide tree over a root box */
+template <int Width>
+AccelStats computeWideStats(const std::vector<WideBVHNode<Width>> &nodes, const AABB &rootBox) {
+  AccelStats stats;
+  stats.nodes = static_cast<int>(nodes.size());
+  if (nodes.empty() || rootBox.surfaceArea() <= 0) return stats;
+  Float cost = SAH_TRAVERSAL_COST * rootBox.surfaceArea() + collectWideStats(nodes, 0, 0, stats);
+  stats.sahCost = cost / rootBox.surfaceArea();
+  return stats;
+}
+
+}  // namespace
+
+template <int Width>
+WideBVHAccel<Width>::WideBVHAccel(
+    MeshPrimitives primitives, BuildMethod method)
+    : primitives(std::move(primitives)) {
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<AABB> bounds(this->primitives.size());
+  for (int i = 0; i < this->primitives.size(); i++)
+    bounds[i] = AABB(this->primitives.getVertex(i, 0), this->primitives.getVertex(i, 1),
+                     this->primitives.getVertex(i, 2));
+  stats.addPhase("bounds", start);
+  std::vector<LinearKdTreeNode> binaryNodes;
+  std::vector<int> primitiveIndices;
+  buildTree(bounds, this->primitives, method, binaryNodes, primitiveIndices);
+  stats.addPhase("build", start);
+  if (!binaryNodes.empty()) {
+    rootBox = binaryNodes[0].box;
+    for (auto &node : binaryNodes) {
+      if (node.nPrimitives == 0) continue;
+      node.primitivesOffset = packTriangleBlocks(
+          this->primitives, primitiveIndices.data() + node.primitivesOffset, node.nPrimitives, blocks);
+    }
+    blocks.shrink_to_fit();
+    stats.addPhase("pack", start);
+    // a wide node replaces at least one binary interior node
+    nodes.reserve(binaryNodes.size() / 2 + 1);
+    collapse(binaryNodes, 0, nodes);
+    nodes.shrink_to_fit();
+    stats.addPhase("collapse", start);
+  }
+  AccelStats shape = computeWideStats(nodes, rootBox);
+  shape.phaseTimes = std::move(stats.phaseTimes);
+  stats = std::move(shape);
+  stats.type = std::string(Width == 4 ? "qbvh" : "obvh") + buildMethodSuffix(method);
+  stats.primitives = this->primitives.size();
+  stats.memoryBytes = nodes.size() * sizeof(WideBVHNode<Width>) + blocks.size() * sizeof(TriangleBlock);
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::intersectHit(HitRecord &hit, const Ray &ray) const {
+  if (nodes.empty()) return false;
+  WideRay wideRay;
+  for (int a = 0; a < 3; a++) {
+    wideRay.origin[a] = ray.origin[a];
+    wideRay.invDir[a] = (ray.direction[a] == 0) ? INF : Float(1) / ray.direction[a];
+    wideRay.dirIsNeg[a] = ray.direction[a] < 0;
+  }
+  Ray clipped = ray;
+  bool found = false;
+
+  struct StackEntry {
+    int child;
+    int count;
+    Float tNear;
+  };
+  StackEntry stack[KD_MAX_DEPTH * (Width - 1) + 1];
+  int stackSize = 0;
+  stack[stackSize++] = {0, 0, clipped.tMin};
+  alignas(32) Float tNear[Width];
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    // skip anything that starts behind the closest hit so far
+    if (entry.tNear > clipped.tMax) continue;
+    if (entry.count > 0) {
+      TRAVERSAL_COUNT_TRIANGLES(entry.count);
+      found |= intersectLeaf(&blocks[entry.child], entry.count, clipped, hit);
+      continue;
+    }
+    const WideBVHNode<Width> &node = nodes[entry.child];
+    TRAVERSAL_COUNT_NODE();
+    int mask = intersectChildren(node, wideRay, clipped.tMin, clipped.tMax, tNear);
+    // push the hit children far to near so the nearest one is popped first
+    int first = stackSize;
+    while (mask) {
+      int i = 0;
+      while (!(mask & (1 << i))) i++;
+      mask &= mask - 1;
+      StackEntry child{node.child[i], node.count[i], tNear[i]};
+      int j = stackSize++;
+      while (j > first && stack[j - 1].tNear < child.tNear) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = child;
+    }
+  }
+  return found;
+}
+
+template <int Width>
+void WideBVHAccel<Width>::resolveHit(Interaction &interaction, const HitRecord &hit,
+                                     const Ray &ray) const {
+  primitives.resolve(interaction, hit, ray);
+}
+
+/**
+ * any-hit traversal, children are visited in node order since any hit ends
+ * the traversal, light triangles do not occlude
+ * @param[in] ray the given ray
+ * @param[in] maxDist the end of the segment
+ * @return whether anything is hit between ray.tMin and maxDist
+ */
+template <int Width>
+bool WideBVHAccel<Width>::occluded(const Ray &ray, Float maxDist) const {
+  if (nodes.empty()) return false;
+  WideRay wideRay;
+  for (int a = 0; a < 3; a++) {
+    wideRay.origin[a] = ray.origin[a];
+    wideRay.invDir[a] = (ray.direction[a] == 0) ? INF : Float(1) / ray.direction[a];
+    wideRay.dirIsNeg[a] = ray.direction[a] < 0;
+  }
+  Ray segment = ray;
+  segment.tMax = std::min(maxDist, ray.tMax);
+
+  struct StackEntry {
+    int child;
+    int count;
+  };
+  StackEntry stack[KD_MAX_DEPTH * (Width - 1) + 1];
+  int stackSize = 0;
+  stack[stackSize++] = {0, 0};
+  alignas(32) Float tNear[Width];
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    if (entry.count > 0) {
+      TRAVERSAL_COUNT_TRIANGLES(entry.count);
+      if (occludedLeaf(&blocks[entry.child], entry.count, primitives, segment)) return true;
+      continue;
+    }
+    const WideBVHNode<Width> &node = nodes[entry.child];
+    TRAVERSAL_COUNT_NODE();
+    int mask = intersectChildren(node, wideRay, segment.tMin, segment.tMax, tNear);
+    while (mask) {
+      int i = 0;
+      while (!(mask & (1 << i))) i++;
+      mask &= mask - 1;
+      stack[stackSize++] = {node.child[i], node.count[i]};
+    }
+  }
+  return false;
+}
+
+template <int Width>
+Float WideBVHAccel<Width>::getBytesPerTriangle() const {
+  if (primitives.empty()) return 0;
+  return static_cast<Float>(stats.memoryBytes) / static_cast<Float>(primitives.size());
+}
+
+template class WideBVHAccel<4>;
+template class WideBVHAccel<8>;
+
+namespace {
+
+/* Decode a quantized bound, q * step is exact since step is a power of two */
+inline Float dequantize(Float origin, int q, Float step) {
+  return origin + static_cast<Float>(q) * step;
+}
+
+/**
+ * quantize the child boxes of a node along one axis, rounding outwards
+ * @param[in] wide the exact child boxes
+ * @param[in] axis the axis
+ * @param[in] exponent a step is 2^exponent
+ * @param[in,out] node node with origin and children set
+ * @return false if the step is too small to enclose every child
+ */
+template <typename Q>
+bool quantizeAxis(const WideBVHNode<4> &wide, int axis, int exponent,
+                  QuantizedBVHNode<Q> &node) {
+  constexpr int qMax = std::numeric_limits<Q>::max();
+  Float origin = node.origin[axis];
+  Float step = std::ldexp(Float(1), exponent);
+  for (int c = 0; c < 4; c++) {
+    if (node.child[c] < 0) {
+      node.bounds[0][axis][c] = node.bounds[1][axis][c] = 0;
+      continue;
+    }
+    Float lb = wide.bounds[0][axis][c], ub = wide.bounds[1][axis][c];
+    // the division may round either way, fix the result up with the decoder
+    int lo = static_cast<int>(std::clamp<Float>(std::floor((lb - origin) / step), 0, qMax));
+    while (lo > 0 && dequantize(origin, lo, step) > lb) lo--;
+    int hi = static_cast<int>(std::clamp<Float>(std::ceil((ub - origin) / step), 0, qMax));
+    while (hi < qMax && dequantize(origin, hi, step) < ub) hi++;
+    if (dequantize(origin, hi, step) < ub) return false;
+    node.bounds[0][axis][c] = static_cast<Q>(lo);
+    node.bounds[1][axis][c] = static_cast<Q>(hi);
+  }
+  return true;
+}
+
+/* Decode the child boxes of a quantized node for the slab test */
+template <typename Q>
+inline void decodeChildren(const QuantizedBVHNode<Q> &node, WideBVHNode<4> &wide) {
+  for (int a = 0; a < 3; a++) {
+    Float step = std::ldexp(Float(1), node.exponent[a]);
+    for (int c = 0; c < 4; c++) {
+      wide.bounds[0][a][c] = dequantize(node.origin[a], node.bounds[0][a][c], step);
+      wide.bounds[1][a][c] = dequantize(node.origin[a], node.bounds[1][a][c], step);
+    }
+  }
+  for (int c = 0; c < 4; c++) {
+    if (node.child[c] >= 0) continue;
+    // empty slot, its box can never be hit
+    for (int a = 0; a < 3; a++) {
+      wide.bounds[0][a][c] = INF;
+      wide.bounds[1][a][c] = -INF;
+    }
+  }
+}
+
+}  // namespace
+
+template <typename Q>
+CompressedBVHAccel<Q>::CompressedBVHAccel(
+    MeshPrimitives primitives, BuildMethod method)
+    : primitives(std::move(primitives)) {
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<AABB> bounds(this->primitives.size());
+  for (int i = 0; i < this->primitives.size(); i++)
+    bounds[i] = AABB(this->primitives.getVertex(i, 0), this->primitives.getVertex(i, 1),
+                     this->primitives.getVertex(i, 2));
+  stats.addPhase("bounds", start);
+  std::vector<LinearKdTreeNode> binaryNodes;
+  buildTree(bounds, this->primitives, method, binaryNodes, primitiveIndices);
+  primitiveIndices.shrink_to_fit();
+  stats.addPhase("build", start);
+  // leaves keep referring to primitiveIndices, the nodes are quantized after
+  // collapsing
+  std::vector<WideBVHNode<4>> wideNodes;
+  if (!binaryNodes.empty()) {
+    rootBox = binaryNodes[0].box;
+    wideNodes.reserve(binaryNodes.size() / 2 + 1);
+    collapse(binaryNodes, 0, wideNodes);
+    stats.addPhase("collapse", start);
+  }
+  nodes.resize(wideNodes.size());
+  constexpr int qMax = std::numeric_limits<Q>::max();
+  for (int i = 0; i < static_cast<int>(wideNodes.size()); i++) {
+    WideBVHNode<4> &wide = wideNodes[i];
+    QuantizedBVHNode<Q> &node = nodes[i];
+    for (int c = 0; c < 4; c++) {
+      node.child[c] = wide.child[c];
+      node.count[c] = static_cast<uint16_t>(wide.count[c]);
+    }
+    for (int a = 0; a < 3; a++) {
+      Float lower = INF, upper = -INF;
+      for (int c = 0; c < 4; c++) {
+        if (node.child[c] < 0) continue;
+        lower = std::min(lower, wide.bounds[0][a][c]);
+        upper = std::max(upper, wide.bounds[1][a][c]);
+      }
+      node.origin[a] = lower;
+      // the smallest power of two step that spans the node in qMax steps,
+      // grown further if rounding of the decoded bounds needs it
+      int exponent;
+      std::frexp((upper - lower) / qMax, &exponent);
+      exponent = std::max(exponent, static_cast<int>(std::numeric_limits<int8_t>::min()));
+      while (!quantizeAxis(wide, a, exponent, node) &&
+             exponent < std::numeric_limits<int8_t>::max())
+        exponent++;
+      node.exponent[a] = static_cast<int8_t>(exponent);
+    }
+    // the statistics see the boxes the traversal sees
+    decodeChildren(node, wide);
+  }
+  if (!wideNodes.empty()) stats.addPhase("quantize", start);
+  AccelStats shape = computeWideStats(wideNodes, rootBox);
+  shape.phaseTimes = std::move(stats.phaseTimes);
+  stats = std::move(shape);
+  stats.type = std::string(sizeof(Q) == 1 ? "cbvh8" : "cbvh16") + buildMethodSuffix(method);
+  stats.primitives = this->primitives.size();
+  stats.memoryBytes = nodes.size() * sizeof(QuantizedBVHNode<Q>) + primitiveIndices.size() * sizeof(int);
+}
+
+template <typename Q>
+bool CompressedBVHAccel<Q>::intersectHit(HitRecord &hit, const Ray &ray) const {
+  if (nodes.empty()) return false;
+  WideRay wideRay;
+  for (int a = 0; a < 3; a++) {
+    wideRay.origin[a] = ray.origin[a];
+    wideRay.invDir[a] = (ray.direction[a] == 0) ? INF : Float(1) / ray.direction[a];
+    wideRay.dirIsNeg[a] = ray.direction[a] < 0;
+  }
+  Ray clipped = ray;
+  bool found = false;
+
+  struct StackEntry {
+    int child;
+    int count;
+    Float tNear;
+  };
+  StackEntry stack[KD_MAX_DEPTH * 3 + 1];
+  int stackSize = 0;
+  stack[stackSize++] = {0, 0, clipped.tMin};
+  WideBVHNode<4> decoded;
+  alignas(32) Float tNear[4];
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    // skip anything that starts behind the closest hit so far
+    if (entry.tNear > clipped.tMax) continue;
+    if (entry.count > 0) {
+      TRAVERSAL_COUNT_TRIANGLES(entry.count);
+      found |= intersectLeaf(primitives, primitiveIndices.data() + entry.child, entry.count, clipped, hit);
+      continue;
+    }
+    const QuantizedBVHNode<Q> &node = nodes[entry.child];
+    TRAVERSAL_COUNT_NODE();
+    decodeChildren(node, decoded);
+    int mask = intersectChildren(decoded, wideRay, clipped.tMin, clipped.tMax, tNear);
+    // push the hit children far to near so the nearest one is popped first
+    int first = stackSize;
+    while (mask) {
+      int i = 0;
+      while (!(mask & (1 << i))) i++;
+      mask &= mask - 1;
+      StackEntry child{node.child[i], node.count[i], tNear[i]};
+      int j = stackSize++;
+      while (j > first && stack[j - 1].tNear < child.tNear) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = child;
+    }
+  }
+  return found;
+}
+
+template <typename Q>
+void CompressedBVHAccel<Q>::resolveHit(Interaction &interaction, const HitRecord &hit,
+                                       const Ray &ray) const {
+  primitives.resolve(interaction, hit, ray);
+}
+
+template <typename Q>
+bool CompressedBVHAccel<Q>::occluded(const Ray &ray, Float maxDist) const {
+  if (nodes.empty()) return false;
+  WideRay wideRay;
+  for (int a = 0; a < 3; a++) {
+    wideRay.origin[a] = ray.origin[a];
+    wideRay.invDir[a] = (ray.direction[a] == 0) ? INF : Float(1) / ray.direction[a];
+    wideRay.dirIsNeg[a] = ray.direction[a] < 0;
+  }
+  Ray segment = ray;
+  segment.tMax = std::min(maxDist, ray.tMax);
+
+  struct StackEntry {
+    int child;
+    int count;
+  };
+  StackEntry stack[KD_MAX_DEPTH * 3 + 1];
+  int stackSize = 0;
+  stack[stackSize++] = {0, 0};
+  WideBVHNode<4> decoded;
+  alignas(32) Float tNear[4];
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    if (entry.count > 0) {
+      TRAVERSAL_COUNT_TRIANGLES(entry.count);
+      if (occludedLeaf(primitives, primitiveIndices.data() + entry.child, entry.count, segment)) return true;
+      continue;
+    }
+    const QuantizedBVHNode<Q> &node = nodes[entry.child];
+    TRAVERSAL_COUNT_NODE();
+    decodeChildren(node, decoded);
+    int mask = intersectChildren(decoded, wideRay, segment.tMin, segment.tMax, tNear);
+    while (mask) {
+      int i = 0;
+      while (!(mask & (1 << i))) i++;
+      mask &= mask - 1;
+      stack[stackSize++] = {node.child[i], node.count[i]};
+    }
+  }
+  return false;
+}
+
+template <typename Q>
+Float CompressedBVHAccel<Q>::getBytesPerTriangle() const {
+  if (primitives.empty()) return 0;
+  return static_cast<Float>(stats.memoryBytes) / static_cast<Float>(primitives.size());
+}
+
+template class CompressedBVHAccel<uint8_t>;
+template class CompressedBVHAccel<uint16_t>;
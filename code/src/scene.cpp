@@ -1,5 +1,13 @@
 #include <scene.h>
 #include <accel.h>
+#include <qbvh.h>
+#include <instance.h>
+#include <snapshot.h>
+#include <traversal_stats.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
 /**
  * Scene class
  */
@@ -26,46 +34,82 @@ std::shared_ptr<Light> Scene::getLight() const { return light; }
 
 std::vector<std::shared_ptr<Light>> Scene::getLights() const { return lights; }
 
+int Scene::countLights() const {
+  return lights.empty() ? 1 : static_cast<int>(lights.size());
+}
+
+std::shared_ptr<Light> Scene::lightAt(int id) const {
+  return lights.empty() ? light : lights[id];
+}
+
 bool Scene::intersect(const Ray &ray, Interaction &interaction) const {
-  Interaction surfaceInteraction;
+  interaction = Interaction();
+  if (hasAccel) {
+    // lights are part of the accelerator, one traversal finds either and
+    // only the closest hit is resolved
+    HitRecord hit;
+    if (!accel->intersectHit(hit, ray)) return false;
+    accel->resolveHit(interaction, hit, ray);
+    if (interaction.type == Interaction::Type::LIGHT)
+      interaction.emission = lightAt(interaction.lightId)
+                                 ->emission(interaction.entryPoint, ray.direction);
+    return true;
+  }
   if (lights.empty())
-    light->intersect(surfaceInteraction, ray);
+    light->intersect(interaction, ray);
   else
   {
       for (auto &lt : lights)
-          lt->intersect(surfaceInteraction, ray);
+          lt->intersect(interaction, ray);
   }
-  if (hasAccel) {
-    Interaction curInteraction;
-    if (accel->intersect(curInteraction, ray)) {
-      if (surfaceInteraction.entryDist == -1 ||
-          curInteraction.entryDist < surfaceInteraction.entryDist) {
-        surfaceInteraction = curInteraction;
-      }
-    }
-  } else {
-    for (auto &geom : geometries) {
-      Interaction curInteraction;
-      if (geom->intersect(curInteraction, ray)) {
-        if (surfaceInteraction.entryDist == -1 ||
-            curInteraction.entryDist < surfaceInteraction.entryDist) {
-          surfaceInteraction = curInteraction;
-        }
-      }
+  // geometries only count in front of the light that was hit
+  Ray clipped = ray;
+  if (interaction.entryDist != -1)
+    clipped.tMax = std::min(ray.tMax, interaction.entryDist);
+  HitRecord hit;
+  const Geometry *closest = nullptr;
+  for (auto &geom : geometries) {
+    if (geom->intersectHit(hit, clipped)) {
+      clipped.tMax = hit.t;
+      closest = geom.get();
     }
   }
+  if (closest) closest->resolveHit(interaction, hit, ray);
 
-  interaction = surfaceInteraction;
-  interaction.emission = surfaceInteraction.emission;
-  if (surfaceInteraction.entryDist != -1 &&
-      surfaceInteraction.entryDist >= ray.tMin &&
-      surfaceInteraction.entryDist <= ray.tMax) {
-    return true;
+  return interaction.entryDist != -1 && interaction.entryDist >= ray.tMin &&
+         interaction.entryDist <= ray.tMax;
+}
+
+void Scene::intersect(const RayPacket<RAY_PACKET_SIZE> &packet,
+                      HitPacket<RAY_PACKET_SIZE> &hits) const {
+  if (!hasAccel) {
+    for (int i = 0; i < packet.size; i++) {
+      TRAVERSAL_SET_LANE(i);
+      hits.hit[i] = intersect(packet.rays[i], hits.interactions[i]);
+    }
+    TRAVERSAL_SET_LANE(0);
+    return;
+  }
+  accel->intersect(packet, hits);
+  for (int i = 0; i < packet.size; i++) {
+    Interaction &interaction = hits.interactions[i];
+    if (!hits.hit[i])
+      interaction = Interaction();
+    else if (interaction.type == Interaction::Type::LIGHT)
+      interaction.emission = lightAt(interaction.lightId)
+                                 ->emission(interaction.entryPoint, packet.rays[i].direction);
   }
+}
+
+bool Scene::occluded(const Ray &ray, Float maxDist) const {
+  if (hasAccel) return accel->occluded(ray, maxDist);
+  for (auto &geom : geometries)
+    if (geom->occluded(ray, maxDist)) return true;
   return false;
 }
 
 bool Scene::isShadowed(const Ray &ray) const {
+  // unlike occluded, a light in front of the geometry ends the ray unshadowed
   Interaction in;
   return intersect(ray, in) && in.type == Interaction::Type::GEOMETRY;
 }
@@ -74,9 +118,173 @@ void Scene::addGeometry(const std::vector<std::shared_ptr<Geometry>> &geoms) {
   for (auto &i : geoms) addGeometry(i);
 }
 
-void Scene::buildAccel() {
+void Scene::buildAccel(AccelType type, BuildMethod method, const std::string &statsPath) {
   if (geometries.empty()) return;
-  accel = std::make_shared<KdTreeAccel>(
-      *(reinterpret_cast<std::vector<std::shared_ptr<Triangle>> *>(&geometries)));
+  auto start = std::chrono::high_resolution_clock::now();
+  accelType = type;
+  buildMethod = method;
+  // instances bring their own object, a built accelerator becomes an
+  // instance of itself and meshes go into the flat tree
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  std::vector<std::shared_ptr<Instance>> instances;
+  meshes.reserve(geometries.size());
+  for (auto &geom : geometries) {
+    if (auto instance = std::dynamic_pointer_cast<Instance>(geom))
+      instances.push_back(instance);
+    else if (auto mesh = std::dynamic_pointer_cast<Mesh>(geom))
+      meshes.push_back(mesh);
+    else if (auto placed = makeIdentityInstance(geom))
+      instances.push_back(placed);
+    else
+      std::clog << "Skipped a geometry that is neither a mesh nor an acceleration structure"
+                << std::endl;
+  }
+  // emissive meshes are tagged with their light
+  std::vector<int> lightIds;
+  for (int id = 0; id < countLights(); id++) {
+    if (!lightAt(id)) continue;
+    for (auto &geom : lightAt(id)->getGeometries()) {
+      auto mesh = std::dynamic_pointer_cast<Mesh>(geom);
+      if (!mesh) {
+        std::clog << "Skipped a geometry of light " << id << " that is not a mesh" << std::endl;
+        continue;
+      }
+      lightIds.resize(meshes.size(), -1);
+      meshes.push_back(mesh);
+      lightIds.push_back(id);
+    }
+  }
+  MeshPrimitives primitives(std::move(meshes), std::move(lightIds));
+  bool hasTriangles = !primitives.empty();
+  AABB bounds;
+  AccelStats stats;
+  switch (type) {
+    case AccelType::QBVH: {
+      auto qbvh = std::make_shared<QBVHAccel>(std::move(primitives), method);
+      bounds = qbvh->getBounds();
+      stats = qbvh->getStats();
+      accel = qbvh;
+      break;
+    }
+    case AccelType::OBVH: {
+      auto obvh = std::make_shared<OBVHAccel>(std::move(primitives), method);
+      bounds = obvh->getBounds();
+      stats = obvh->getStats();
+      accel = obvh;
+      break;
+    }
+    case AccelType::CBVH8: {
+      auto cbvh = std::make_shared<CompressedBVH8Accel>(std::move(primitives), method);
+      bounds = cbvh->getBounds();
+      stats = cbvh->getStats();
+      accel = cbvh;
+      break;
+    }
+    case AccelType::CBVH16: {
+      auto cbvh = std::make_shared<CompressedBVH16Accel>(std::move(primitives), method);
+      bounds = cbvh->getBounds();
+      stats = cbvh->getStats();
+      accel = cbvh;
+      break;
+    }
+    default: {
+      auto kdTree = std::make_shared<KdTreeAccel>(std::move(primitives), method);
+      bounds = kdTree->getBounds();
+      stats = kdTree->getStats();
+      accel = kdTree;
+      break;
+    }
+  }
+  const Geometry *flat = accel.get();
+  if (!instances.empty()) {
+    // two levels, the plain triangles become one more instance
+    if (hasTriangles)
+      instances.push_back(
+          std::make_shared<Instance>(accel, bounds, Matrix4x4::Identity()));
+    accel = std::make_shared<InstanceAccel>(instances);
+  }
+  hasAccel = true;
+  if (statsPath.empty()) return;
+
+  std::ofstream file(statsPath, std::ios::trunc);
+  file << "{\n  \"triangles\": " << stats.toJson("  ");
+  if (auto instanceAccel = std::dynamic_pointer_cast<InstanceAccel>(accel)) {
+    file << ",\n  \"instances\": " << instanceAccel->getStats().toJson("  ");
+    // every shared object once, they were built before the scene
+    file << ",\n  \"objects\": [";
+    std::unordered_set<const Geometry *> seen{flat};
+    for (auto &instance : instanceAccel->getInstances()) {
+      auto object = std::dynamic_pointer_cast<KdTreeAccel>(instance->getObject());
+      if (!object || !seen.insert(object.get()).second) continue;
+      file << (seen.size() > 2 ? ", " : "") << object->getStats().toJson("  ");
+    }
+    file << "]";
+  }
+  file << ",\n  \"sceneMs\": "
+       << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+       << "\n}\n";
+  if (!file) std::clog << "Failed to write acceleration statistics " << statsPath << std::endl;
+}
+
+void Scene::refitAccel() {
+  if (hasAccel) {
+    if (auto kdTree = std::dynamic_pointer_cast<KdTreeAccel>(accel)) {
+      kdTree->refit();
+      return;
+    }
+    auto instanceAccel = std::dynamic_pointer_cast<InstanceAccel>(accel);
+    if (instanceAccel && instanceAccel->refit()) return;
+  }
+  buildAccel(accelType, buildMethod);
+}
+
+bool Scene::saveSnapshot(const std::string &path, uint64_t key,
+                         const std::vector<std::shared_ptr<BRDF>> &materials) const {
+  if (!hasAccel) return false;
+  SnapshotWriter out(materials);
+  if (auto kdTree = std::dynamic_pointer_cast<KdTreeAccel>(accel)) {
+    out.write(0);
+    kdTree->save(out);
+  } else if (auto instanceAccel = std::dynamic_pointer_cast<InstanceAccel>(accel)) {
+    out.write(1);
+    instanceAccel->save(out);
+  } else {
+    return false;
+  }
+  return out.finish(path, key);
+}
+
+bool Scene::loadSnapshot(const std::string &path, uint64_t key,
+                         const std::vector<std::shared_ptr<BRDF>> &materials) {
+  SnapshotReader in(path, key, materials);
+  if (!in.ok()) return false;
+  std::shared_ptr<Geometry> loaded;
+  switch (in.read<int>()) {
+    case 0:
+      loaded = KdTreeAccel::load(in);
+      break;
+    case 1:
+      loaded = InstanceAccel::load(in);
+      break;
+    default:
+      break;
+  }
+  if (!loaded || !in.ok()) return false;
+  // the stored light ids must name lights of this scene
+  auto hasValidLightIds = [this](const Geometry &geom) {
+    auto kdTree = dynamic_cast<const KdTreeAccel *>(&geom);
+    if (!kdTree) return false;
+    for (int id : kdTree->getPrimitives().getLightIds())
+      if (id >= countLights() || (id >= 0 && !lightAt(id))) return false;
+    return true;
+  };
+  if (auto instanceAccel = std::dynamic_pointer_cast<InstanceAccel>(loaded)) {
+    for (auto &instance : instanceAccel->getInstances())
+      if (!hasValidLightIds(*instance->getObject())) return false;
+  } else if (!hasValidLightIds(*loaded)) {
+    return false;
+  }
+  accel = loaded;
   hasAccel = true;
+  return true;
 }
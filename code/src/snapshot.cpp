@@ -0,0 +1,210 @@
+#include <snapshot.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t floatSize;
+  uint64_t key;
+  uint64_t nMeshes;
+  uint64_t meshBytes;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'C', 'S', 'S', 'N', 'A', 'P', 0, 0};
+
+// a mesh geometry is stored as its vertex data and its material
+struct MeshRecord {
+  int mesh;
+  int material;  // -1 for no material, e.g. the mesh of a light
+};
+
+template <typename T>
+void appendArray(std::vector<char> &buffer, const std::vector<T> &values) {
+  uint64_t count = values.size();
+  const char *bytes = reinterpret_cast<const char *>(&count);
+  buffer.insert(buffer.end(), bytes, bytes + sizeof(count));
+  bytes = reinterpret_cast<const char *>(values.data());
+  buffer.insert(buffer.end(), bytes, bytes + count * sizeof(T));
+}
+
+}  // namespace
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; i++) {
+    seed ^= bytes[i];
+    seed *= 1099511628211ull;
+  }
+  return seed;
+}
+
+uint64_t hashFile(const std::string &path, uint64_t seed) {
+  seed = hashBytes(path.data(), path.size(), seed);
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> chunk(1 << 16);
+  while (file) {
+    file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    seed = hashBytes(chunk.data(), static_cast<size_t>(file.gcount()), seed);
+  }
+  return seed;
+}
+
+/**
+ * SnapshotWriter class
+ */
+SnapshotWriter::SnapshotWriter(const std::vector<std::shared_ptr<BRDF>> &materials)
+    : materials(materials) {}
+
+void SnapshotWriter::append(std::vector<char> &buffer, const void *data,
+                            size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+void SnapshotWriter::writeMesh(const Mesh &geometry) {
+  const TriangleMesh *mesh = geometry.getMesh().get();
+  auto it = meshIds.find(mesh);
+  if (it == meshIds.end()) {
+    it = meshIds.emplace(mesh, static_cast<int>(meshIds.size())).first;
+    append(meshData, &mesh->nVertices, sizeof(int));
+    appendArray(meshData, mesh->indices);
+    appendArray(meshData, mesh->p);
+    appendArray(meshData, mesh->n);
+    appendArray(meshData, mesh->uv);
+  }
+  MeshRecord record{it->second, -1};
+  if (geometry.getMaterial()) {
+    auto mat = std::find(materials.begin(), materials.end(), geometry.getMaterial());
+    // a material outside the table cannot be restored
+    if (mat == materials.end()) fail();
+    record.material = static_cast<int>(mat - materials.begin());
+  }
+  write(record);
+}
+
+bool SnapshotWriter::addObject(const void *object, int &index) {
+  auto it = objectIds.find(object);
+  if (it != objectIds.end()) {
+    index = it->second;
+    return false;
+  }
+  index = static_cast<int>(objectIds.size());
+  objectIds.emplace(object, index);
+  return true;
+}
+
+bool SnapshotWriter::finish(const std::string &path, uint64_t key) {
+  if (!good) return false;
+  SnapshotHeader header{};
+  std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.floatSize = sizeof(Float);
+  header.key = key;
+  header.nMeshes = meshIds.size();
+  header.meshBytes = meshData.size();
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(meshData.data(), static_cast<std::streamsize>(meshData.size()));
+  file.write(body.data(), static_cast<std::streamsize>(body.size()));
+  if (!file) {
+    std::clog << "Failed to write snapshot " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * SnapshotReader class
+ */
+SnapshotReader::SnapshotReader(const std::string &path, uint64_t key,
+                               const std::vector<std::shared_ptr<BRDF>> &materials)
+    : materials(materials) {
+#if !defined(_WIN32)
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat info {};
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void *mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED) {
+      data = static_cast<const char *>(mapping);
+      size = static_cast<size_t>(info.st_size);
+      mapped = true;
+    }
+  }
+  close(fd);
+#endif
+  if (!mapped) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return;
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    data = buffer.data();
+    size = buffer.size();
+  }
+  good = true;
+  auto header = read<SnapshotHeader>();
+  good = good && std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+         header.version == SNAPSHOT_VERSION && header.floatSize == sizeof(Float) &&
+         header.key == key;
+  // every mesh takes more than a byte, a larger count is damaged
+  good = good && header.nMeshes <= size;
+  if (!good) return;
+  meshes.reserve(header.nMeshes);
+  for (uint64_t i = 0; i < header.nMeshes && good; i++) {
+    auto nVertices = read<int>();
+    std::vector<int> indices;
+    std::vector<vec3> p, n;
+    std::vector<vec2> uv;
+    readArray(indices);
+    readArray(p);
+    readArray(n);
+    readArray(uv);
+    auto sizeOk = [nVertices](size_t count) {
+      return count == 0 || count == static_cast<size_t>(nVertices);
+    };
+    if (!good || nVertices != static_cast<int>(p.size()) || !sizeOk(n.size()) ||
+        !sizeOk(uv.size()) || indices.size() % 3 != 0 ||
+        std::any_of(indices.begin(), indices.end(),
+                    [nVertices](int index) { return index < 0 || index >= nVertices; })) {
+      good = false;
+      return;
+    }
+    meshes.push_back(std::make_shared<TriangleMesh>(indices, nVertices, p, n, uv));
+  }
+}
+
+SnapshotReader::~SnapshotReader() {
+#if !defined(_WIN32)
+  if (mapped) munmap(const_cast<char *>(data), size);
+#endif
+}
+
+void SnapshotReader::take(void *out, size_t bytes) {
+  if (!good || bytes > size - offset) {
+    good = false;
+    return;
+  }
+  std::memcpy(out, data + offset, bytes);
+  offset += bytes;
+}
+
+std::shared_ptr<Mesh> SnapshotReader::readMesh() {
+  auto record = read<MeshRecord>();
+  if (!good || record.mesh < 0 || record.mesh >= static_cast<int>(meshes.size()) ||
+      record.material < -1 || record.material >= static_cast<int>(materials.size())) {
+    good = false;
+    return nullptr;
+  }
+  return std::make_shared<Mesh>(meshes[record.mesh],
+                                record.material < 0 ? nullptr : materials[record.material]);
+}
@@ -1,12 +1,20 @@
 #include <viewpoints.h>
 #include <ray.h>
 #include <geometry.h>
+#include <algorithm>
+#include <cstdint>
+#define USE_OPENMP 1
+
+namespace {
+// largest cell coordinate of a point, searches may go a bit further
+constexpr Float MAX_GRID_CELL = static_cast<Float>(1 << 29);
+}  // namespace
 
 ViewPoint::ViewPoint(vec3 pos, vec3 N, vec3 color, double stgh, int x, int y)
  : C(pos), N(N), color(color), strength(stgh), x(x), y(y) {}
 
 
-KdPointTreeNode::KdPointTreeNode(std::vector<std::shared_ptr<ViewPoint>> viewpoints, AABB box, int depth)
+KdPointTreeNode::KdPointTreeNode(std::vector<const ViewPoint*> viewpoints, AABB box, int depth)
 {
   this->box = box;
   if (viewpoints.size() < 8 || depth > 40) // 0 5 10 20 20 20
@@ -25,7 +33,7 @@ KdPointTreeNode::KdPointTreeNode(std::vector<std::shared_ptr<ViewPoint>> viewpoi
   int split_axis = depth % 3;
   float split_value;
 
-  for (int i = 0; i < viewpoints.size(); i++) {
+  for (int i = 0; i < static_cast<int>(viewpoints.size()); i++) {
     auto t = viewpoints[i];
     centers.push_back(t->C[split_axis]);
   }
@@ -43,8 +51,8 @@ KdPointTreeNode::KdPointTreeNode(std::vector<std::shared_ptr<ViewPoint>> viewpoi
   rightSpace.lb[split_axis] = split_value;
 
   // TODO: put the corresponding overlapping viewpoints
-  std::vector<std::shared_ptr<ViewPoint>> leftViewpoints;
-  std::vector<std::shared_ptr<ViewPoint>> rightViewpoints;
+  std::vector<const ViewPoint*> leftViewpoints;
+  std::vector<const ViewPoint*> rightViewpoints;
 
   for (auto& temp : viewpoints) {
     if (temp->C[split_axis] <= split_value) {
@@ -59,7 +67,7 @@ KdPointTreeNode::KdPointTreeNode(std::vector<std::shared_ptr<ViewPoint>> viewpoi
   rightChild = new KdPointTreeNode(rightViewpoints, rightSpace, depth + 1);
 }
 
-void KdPointTreeNode::search(std::vector<std::shared_ptr<ViewPoint>>& result, const vec3& pos, double r)
+void KdPointTreeNode::search(std::vector<const ViewPoint*>& result, const vec3& pos, double r)
 {
   AABB tmp_box(pos - vec3(r, r, r), pos + vec3(r, r, r));
   if (!box.isOverlap(tmp_box)) return;
@@ -89,15 +97,102 @@ KdPointTreeNode::~KdPointTreeNode() {
   }
 }
 
-KdPointTree::KdPointTree(const std::vector<std::shared_ptr<ViewPoint>>& viewpoints)
+KdPointTree::KdPointTree(const std::vector<ViewPoint>& viewpoints)
 {
   AABB box;
-  for (auto& p : viewpoints)
-    box = AABB(box, p->C);
-  root = std::move(std::make_unique<KdPointTreeNode>(viewpoints, box, 0));
+  std::vector<const ViewPoint*> points;
+  points.reserve(viewpoints.size());
+  for (auto& p : viewpoints) {
+    box = AABB(box, p.C);
+    points.push_back(&p);
+  }
+  root = std::move(std::make_unique<KdPointTreeNode>(std::move(points), box, 0));
 }
 
-void KdPointTree::search(std::vector<std::shared_ptr<ViewPoint>>& result, const vec3& pos, double r)
+void KdPointTree::search(std::vector<const ViewPoint*>& result, const vec3& pos, double r)
 {
   if (root) return root->search(result, pos, r);
-}
\ No newline at end of file
+}
+
+ViewPointGrid::ViewPointGrid(const std::vector<ViewPoint>& viewpoints, Float radius)
+{
+  int n = static_cast<int>(viewpoints.size());
+  // no point is closer than a radius of 0, keep the grid empty
+  if (n == 0 || !(radius > 0)) return;
+  // the cells may be wider than 2 * radius, but not so narrow that the cell
+  // coordinates of the points overflow
+  Float extent = 1;
+  for (auto& p : viewpoints) extent = std::max(extent, p.C.cwiseAbs().maxCoeff());
+  invCellSize = std::min(1 / (2 * radius), MAX_GRID_CELL / extent);
+  int buckets = 1;
+  while (buckets < n) buckets <<= 1;
+  mask = buckets - 1;
+
+  // counting sort of the points by bucket, the counts are shifted by one so
+  // that the prefix sum turns them into the bucket starts
+  std::vector<int> keys(n);
+  cellStart.assign(buckets + 1, 0);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int i = 0; i < n; i++) {
+    keys[i] = bucket(cellOf(viewpoints[i].C));
+#ifdef USE_OPENMP
+#pragma omp atomic
+#endif
+    cellStart[keys[i] + 1]++;
+  }
+  for (int b = 0; b < buckets; b++)
+    cellStart[b + 1] += cellStart[b];
+
+  std::vector<int> cursor(cellStart.begin(), cellStart.end() - 1);
+  indices.resize(n);
+  positions.resize(n);
+#ifdef USE_OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for (int i = 0; i < n; i++) {
+    int slot;
+#ifdef USE_OPENMP
+#pragma omp atomic capture
+#endif
+    slot = cursor[keys[i]]++;
+    indices[slot] = i;
+    positions[slot] = viewpoints[i].C;
+  }
+}
+
+Vector3<int> ViewPointGrid::cellOf(const vec3& pos) const
+{
+  // positions far outside the points fall into the outermost cells
+  vec3 cell = (pos * invCellSize).array().floor().max(-2 * MAX_GRID_CELL).min(2 * MAX_GRID_CELL);
+  return cell.cast<int>();
+}
+
+int ViewPointGrid::bucket(const Vector3<int>& cell) const
+{
+  // spatial hash of Teschner et al., unsigned to wrap around on overflow
+  auto h = (static_cast<uint32_t>(cell.x()) * 73856093u) ^
+           (static_cast<uint32_t>(cell.y()) * 19349663u) ^
+           (static_cast<uint32_t>(cell.z()) * 83492791u);
+  return static_cast<int>(h & static_cast<uint32_t>(mask));
+}
+
+void ViewPointGrid::search(std::vector<int>& result, const vec3& pos, Float r) const
+{
+  if (positions.empty()) return;
+  // the lower corner of the search box decides the 2x2x2 block of cells
+  Vector3<int> first = cellOf(pos - vec3(r, r, r));
+  int visited[8];
+  int nVisited = 0;
+  for (int i = 0; i < 8; i++) {
+    int b = bucket(Vector3<int>(first.x() + (i & 1), first.y() + ((i >> 1) & 1), first.z() + (i >> 2)));
+    // different cells may share a bucket, scan it once
+    if (std::find(visited, visited + nVisited, b) != visited + nVisited) continue;
+    visited[nVisited++] = b;
+    for (int j = cellStart[b]; j < cellStart[b + 1]; j++) {
+      if ((positions[j] - pos).squaredNorm() < r * r)
+        result.push_back(indices[j]);
+    }
+  }
+}
@@ -0,0 +1,95 @@
+#ifndef CS171_TESTS_ACCEL_CHECK_H_
+#define CS171_TESTS_ACCEL_CHECK_H_
+#include <accel.h>
+#include <scene.h>
+#include <test.h>
+#include <cmath>
+#include <random>
+
+/* Rays between random points of the box [-1.5, 1.5]^3 */
+inline std::vector<Ray> makeRandomRays(int n, std::mt19937 &rng) {
+  std::uniform_real_distribution<Float> coord(-1.5f, 1.5f);
+  std::vector<Ray> rays;
+  for (int i = 0; i < n; i++) {
+    vec3 origin(coord(rng), coord(rng), coord(rng));
+    vec3 target(coord(rng), coord(rng), coord(rng));
+    rays.emplace_back(origin, target - origin);
+  }
+  return rays;
+}
+
+inline bool sameDistance(Float a, Float b) {
+  return std::abs(a - b) <= 1e-4f * std::max(Float(1), std::abs(b));
+}
+
+/**
+ * compare closest hits and any-hit tests of an accelerator with testing
+ * every triangle of every mesh, light meshes do not occlude
+ * @param[in] intersectHit, occluded the queries of the accelerator
+ * @param[in] meshes, lightIds what the accelerator was built over
+ */
+template <typename IntersectHit, typename Occluded>
+void checkQueries(IntersectHit &&intersectHit, Occluded &&occluded,
+                  const std::vector<std::shared_ptr<Mesh>> &meshes,
+                  const std::vector<int> &lightIds, const std::vector<Ray> &rays) {
+  for (const Ray &ray : rays) {
+    HitRecord expected;
+    Ray clipped = ray;
+    bool expectedHit = false;
+    for (auto &mesh : meshes) {
+      if (mesh->intersectHit(expected, clipped)) {
+        clipped.tMax = expected.t;
+        expectedHit = true;
+      }
+    }
+    HitRecord hit;
+    bool found = intersectHit(hit, ray);
+    CHECK(found == expectedHit);
+    if (found && expectedHit) CHECK(sameDistance(hit.t, expected.t));
+
+    // a segment ending half way to the closest hit, and one past it
+    for (Float maxDist : {expectedHit ? expected.t * 0.5f : Float(2), expectedHit ? expected.t * 1.5f : INF}) {
+      bool expectedOccluded = false;
+      for (size_t m = 0; m < meshes.size(); m++)
+        if ((lightIds.empty() || lightIds[m] < 0) && meshes[m]->occluded(ray, maxDist))
+          expectedOccluded = true;
+      CHECK(occluded(ray, maxDist) == expectedOccluded);
+    }
+  }
+}
+
+/* checkQueries with the queries of a Geometry */
+inline void checkAccel(const Geometry &accel, const std::vector<std::shared_ptr<Mesh>> &meshes,
+                       const std::vector<int> &lightIds, const std::vector<Ray> &rays) {
+  checkQueries([&](HitRecord &hit, const Ray &ray) { return accel.intersectHit(hit, ray); },
+               [&](const Ray &ray, Float maxDist) { return accel.occluded(ray, maxDist); },
+               meshes, lightIds, rays);
+}
+
+/* checkQueries with the stackless queries of a k-d tree */
+inline void checkStackless(const KdTreeAccel &tree, const std::vector<std::shared_ptr<Mesh>> &meshes,
+                           const std::vector<int> &lightIds, const std::vector<Ray> &rays) {
+  checkQueries([&](HitRecord &hit, const Ray &ray) { return tree.intersectHitStackless(hit, ray); },
+               [&](const Ray &ray, Float maxDist) { return tree.occludedStackless(ray, maxDist); },
+               meshes, lightIds, rays);
+}
+
+/**
+ * compare the intersections of a scene with a copy of it that tests every
+ * geometry and light, the scene must have a list of lights
+ */
+inline void checkScene(const Scene &scene, const std::vector<Ray> &rays) {
+  Scene reference(scene.getLights());
+  reference.addGeometry(scene.getGeometries());
+  for (const Ray &ray : rays) {
+    Interaction found, expected;
+    bool hit = scene.intersect(ray, found);
+    bool expectedHit = reference.intersect(ray, expected);
+    CHECK(hit == expectedHit);
+    if (!hit || !expectedHit) continue;
+    CHECK(found.type == expected.type);
+    CHECK(sameDistance(found.entryDist, expected.entryDist));
+  }
+}
+
+#endif  // CS171_TESTS_ACCEL_CHECK_H_
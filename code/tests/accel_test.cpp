@@ -0,0 +1,73 @@
+#include <accel_check.h>
+#include <qbvh.h>
+#include <omp.h>
+
+namespace {
+
+/* A mesh of n small random triangles in [-1, 1]^3 */
+std::shared_ptr<Mesh> makeRandomMesh(int n, std::mt19937 &rng) {
+  std::uniform_real_distribution<Float> coord(-1, 1), offset(-0.1f, 0.1f);
+  std::vector<int> indices;
+  std::vector<vec3> p, normals;
+  std::vector<vec2> uv;
+  for (int i = 0; i < n; i++) {
+    vec3 center(coord(rng), coord(rng), coord(rng));
+    for (int j = 0; j < 3; j++) {
+      indices.push_back(static_cast<int>(p.size()));
+      p.push_back(center + vec3(offset(rng), offset(rng), offset(rng)));
+      normals.emplace_back(0, 1, 0);
+      uv.emplace_back(0, 0);
+    }
+  }
+  auto mesh = std::make_shared<TriangleMesh>(indices, static_cast<int>(p.size()), p, normals, uv);
+  return std::make_shared<Mesh>(mesh, makeIdealDiffusion(vec3(0.5, 0.5, 0.5)));
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(3);
+  std::vector<std::shared_ptr<Mesh>> meshes{makeRandomMesh(600, rng), makeRandomMesh(150, rng),
+                                            makeRandomMesh(30, rng)};
+  // the last mesh stands for the triangles of an area light
+  std::vector<int> lightIds{-1, -1, 0};
+  std::vector<Ray> rays = makeRandomRays(256, rng);
+
+  for (BuildMethod method : {BuildMethod::SAH, BuildMethod::SBVH, BuildMethod::LBVH}) {
+    MeshPrimitives primitives(meshes, lightIds);
+    KdTreeAccel kdTree(primitives, method);
+    checkAccel(kdTree, meshes, lightIds, rays);
+    checkStackless(kdTree, meshes, lightIds, rays);
+    checkAccel(QBVHAccel(primitives, method), meshes, lightIds, rays);
+    checkAccel(OBVHAccel(primitives, method), meshes, lightIds, rays);
+    checkAccel(CompressedBVH8Accel(primitives, method), meshes, lightIds, rays);
+    checkAccel(CompressedBVH16Accel(primitives, method), meshes, lightIds, rays);
+
+    // packets find the same hits as single rays
+    for (size_t i = 0; i + RAY_PACKET_SIZE <= rays.size(); i += RAY_PACKET_SIZE) {
+      RayPacket<RAY_PACKET_SIZE> packet;
+      HitPacket<RAY_PACKET_SIZE> hits;
+      for (int j = 0; j < RAY_PACKET_SIZE; j++) packet.add(rays[i + j]);
+      kdTree.intersect(packet, hits);
+      for (int j = 0; j < RAY_PACKET_SIZE; j++) {
+        HitRecord hit;
+        bool found = kdTree.intersectHit(hit, packet.rays[j]);
+        CHECK(hits.hit[j] == found);
+        if (found && hits.hit[j]) CHECK(sameDistance(hits.interactions[j].entryDist, hit.t));
+      }
+    }
+  }
+
+  // the spatial split budget is shared out before the subtrees are built as
+  // tasks, so the tree does not depend on the number of threads
+  std::vector<std::shared_ptr<Mesh>> large{makeRandomMesh(KD_PARALLEL_BUILD_SIZE + KD_PARALLEL_BUILD_SIZE / 2, rng)};
+  omp_set_num_threads(1);
+  AccelStats serial = KdTreeAccel(MeshPrimitives(large), BuildMethod::SBVH).getStats();
+  omp_set_num_threads(4);
+  AccelStats parallel = KdTreeAccel(MeshPrimitives(large), BuildMethod::SBVH).getStats();
+  CHECK(serial.references == parallel.references);
+  CHECK(serial.nodes == parallel.nodes);
+  CHECK(serial.leafSizeHistogram == parallel.leafSizeHistogram);
+  CHECK(serial.sahCost == parallel.sahCost);
+  return testFailures() ? 1 : 0;
+}
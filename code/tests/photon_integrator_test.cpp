@@ -0,0 +1,77 @@
+#include <integrator.h>
+#include <cornell_box.h>
+#include <test.h>
+#include <cmath>
+#include <filesystem>
+#include <omp.h>
+
+namespace {
+
+/**
+ * render scene 0 on a small film with the photon integrator, from the same
+ * random numbers every time
+ * @param[in] rounds the render rounds
+ * @param[in] configure sets the options of the integrator under test
+ * @return the pixels of the image
+ */
+template <typename Configure>
+std::vector<vec3> render(Scene &scene, int rounds, Configure &&configure) {
+  auto camera = genCamera(0, vec2i(32, 32));
+  PhotonIntegrator integrator(camera, rounds, 10000, 0.15f, 0.8f, 8, 8, 1);
+  configure(integrator);
+  randomEngine().seed(1);
+  integrator.render(scene);
+  return camera->getFilm().pixels;
+}
+
+/* Whether every pixel is finite, not negative and some are lit */
+bool isValidImage(const std::vector<vec3> &pixels) {
+  Float sum = 0;
+  for (const vec3 &pixel : pixels) {
+    if (!pixel.allFinite() || (pixel.array() < 0).any()) return false;
+    sum += pixel.sum();
+  }
+  return sum > 0;
+}
+
+/* Whether two images agree up to the order the flux of a pixel was summed in */
+bool sameImage(const std::vector<vec3> &a, const std::vector<vec3> &b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++)
+    if (((a[i] - b[i]).array().abs() > 1e-4f * (1 + b[i].array().abs())).any()) return false;
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  auto scene = genCornellBoxScene(0);
+  // the integrator writes an image every round, keep them out of the tree
+  std::filesystem::current_path(std::filesystem::temp_directory_path());
+  // the threads would draw the random numbers in any order
+  omp_set_num_threads(1);
+
+  // the hash grid and the KdPointTree find the same view points
+  std::vector<vec3> grid = render(*scene, 2, [](PhotonIntegrator &integrator) { integrator.setHashGrid(true); });
+  std::vector<vec3> tree = render(*scene, 2, [](PhotonIntegrator &integrator) { integrator.setHashGrid(false); });
+  CHECK(isValidImage(grid));
+  CHECK(sameImage(grid, tree));
+
+  // in the first round every pixel still has the initial radius, so the
+  // progressive estimate is the one of the global schedule
+  std::vector<vec3> global = render(*scene, 1, [](PhotonIntegrator &integrator) { integrator.setProgressive(false); });
+  std::vector<vec3> progressive = render(*scene, 1, [](PhotonIntegrator &integrator) { integrator.setProgressive(true); });
+  CHECK(sameImage(progressive, global));
+  // later rounds search the largest radius of the pixels, either search
+  // must pass every view point within its own radius to the photon
+  std::vector<vec3> progressiveGrid = render(*scene, 2, [](PhotonIntegrator &integrator) {
+    integrator.setProgressive(true);
+  });
+  std::vector<vec3> progressiveTree = render(*scene, 2, [](PhotonIntegrator &integrator) {
+    integrator.setProgressive(true);
+    integrator.setHashGrid(false);
+  });
+  CHECK(isValidImage(progressiveGrid));
+  CHECK(sameImage(progressiveGrid, progressiveTree));
+  return testFailures() ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+#include <photonmap.h>
+#include <test.h>
+#include <algorithm>
+#include <random>
+
+namespace {
+
+/* The k nearest photons by sorting all of them, the reference of PhotonMap::nearest */
+std::vector<NearPhoton> bruteForceNearest(const std::vector<Photon> &photons, const vec3 &pos, int k,
+                                          Float maxDist2, const vec3 *normal) {
+  std::vector<NearPhoton> result;
+  for (int i = 0; i < static_cast<int>(photons.size()); i++) {
+    Float dist2 = (photons[i].position - pos).squaredNorm();
+    if (dist2 < maxDist2 && (!normal || photons[i].direction.dot(*normal) < 0))
+      result.push_back({dist2, i});
+  }
+  std::sort(result.begin(), result.end());
+  if (result.size() > static_cast<size_t>(k)) result.resize(k);
+  return result;
+}
+
+/* Compare the distances found by the map and by brute force for random queries */
+void checkNearest(const std::vector<Photon> &photons, int k, Float maxDist2, bool filter) {
+  PhotonMap map(photons);
+  CHECK(map.size() == photons.size());
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<Float> coord(-1.2f, 1.2f);
+  std::vector<NearPhoton> found;
+  for (int q = 0; q < 200; q++) {
+    vec3 pos(coord(rng), coord(rng), coord(rng));
+    vec3 normal = vec3(coord(rng), coord(rng), coord(rng)).normalized();
+    const vec3 *n = filter ? &normal : nullptr;
+    Float radius2 = map.nearest(found, pos, k, maxDist2, n);
+    std::vector<NearPhoton> expected = bruteForceNearest(photons, pos, k, maxDist2, n);
+    CHECK(found.size() == expected.size());
+    if (found.size() != expected.size()) continue;
+    std::sort_heap(found.begin(), found.end());
+    for (size_t i = 0; i < found.size(); i++) {
+      CHECK(found[i].dist2 == expected[i].dist2);
+      const Photon &photon = map.getPhoton(found[i].index);
+      CHECK((photon.position - pos).squaredNorm() == found[i].dist2);
+      if (filter) CHECK(photon.direction.dot(normal) < 0);
+    }
+    if (expected.size() == static_cast<size_t>(k))
+      CHECK(radius2 == expected.back().dist2);
+    else
+      CHECK(radius2 == maxDist2);
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<Float> coord(-1, 1);
+  std::vector<Photon> photons(5000);
+  for (auto &photon : photons) {
+    photon.position = vec3(coord(rng), coord(rng), coord(rng));
+    photon.direction = vec3(coord(rng), coord(rng), coord(rng)).normalized();
+    photon.power = vec3(1, 1, 1);
+  }
+  // photons on a plane share their coordinate along one axis
+  std::vector<Photon> plane = photons;
+  for (auto &photon : plane) photon.position.y() = 0;
+
+  for (bool filter : {false, true}) {
+    checkNearest(photons, 1, INF, filter);
+    checkNearest(photons, 64, INF, filter);
+    checkNearest(photons, 64, 0.01f, filter);
+    checkNearest(plane, 64, 0.05f, filter);
+  }
+  checkNearest({}, 8, 1, false);
+  return testFailures() ? 1 : 0;
+}
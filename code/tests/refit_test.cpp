@@ -0,0 +1,113 @@
+#include <accel_check.h>
+#include <cornell_box.h>
+#include <instance.h>
+#include <qbvh.h>
+#include <algorithm>
+
+namespace {
+
+/* The meshes of a scene, the scenes tested here have no instances */
+std::vector<std::shared_ptr<Mesh>> meshesOf(const Scene &scene) {
+  std::vector<std::shared_ptr<Mesh>> meshes;
+  for (auto &geom : scene.getGeometries())
+    if (auto mesh = std::dynamic_pointer_cast<Mesh>(geom)) meshes.push_back(mesh);
+  return meshes;
+}
+
+/* Camera rays through every fourth pixel of a 64x64 film and random rays */
+std::vector<Ray> makeSceneRays(int id, std::mt19937 &rng) {
+  auto camera = genCamera(id, vec2i(64, 64));
+  std::vector<Ray> rays = makeRandomRays(128, rng);
+  for (int dx = 0; dx < 64; dx += 4)
+    for (int dy = 0; dy < 64; dy += 4) rays.push_back(camera->generateRay(dx, dy));
+  return rays;
+}
+
+/* Move every vertex by a random offset of at most amount along each axis */
+void jitter(const std::vector<std::shared_ptr<Mesh>> &meshes, Float amount, std::mt19937 &rng) {
+  std::uniform_real_distribution<Float> offset(-amount, amount);
+  for (auto &mesh : meshes)
+    for (auto &p : mesh->getMesh()->p) p += vec3(offset(rng), offset(rng), offset(rng));
+}
+
+/**
+ * refit the scene and a k-d tree over its meshes after small and large
+ * deformations, both must find the hits of testing every triangle, the
+ * stackless traversal of the refit tree too
+ * @param[in] rebuild scatter the largest mesh and expect the tree to be
+ *            rebuilt, the scene needs a mesh of many triangles for that
+ */
+void checkRefit(int id, bool rebuild) {
+  std::mt19937 rng(id);
+  auto scene = genCornellBoxScene(id);
+  std::vector<std::shared_ptr<Mesh>> meshes = meshesOf(*scene);
+  std::vector<Ray> rays = makeSceneRays(id, rng);
+  KdTreeAccel tree{MeshPrimitives(meshes)};
+  scene->buildAccel();
+  Float builtCost = tree.getStats().sahCost;
+
+  // a small deformation keeps the tree, which is only refit
+  jitter(meshes, 0.002f, rng);
+  CHECK(!tree.refit());
+  CHECK(tree.getStats().sahCost <= builtCost * REFIT_REBUILD_RATIO);
+  checkAccel(tree, meshes, {}, rays);
+  checkStackless(tree, meshes, {}, rays);
+  scene->refitAccel();
+  checkScene(*scene, rays);
+
+  if (rebuild) {
+    // scattering the vertices of the largest mesh turns its triangles into
+    // long slivers across the box, the refit tree is then worse than a new one
+    auto largest = *std::max_element(meshes.begin(), meshes.end(), [](auto &a, auto &b) {
+      return a->countTriangles() < b->countTriangles();
+    });
+    std::vector<vec3> &p = largest->getMesh()->p;
+    std::shuffle(p.begin(), p.end(), rng);
+    CHECK(tree.refit());
+    checkAccel(tree, meshes, {}, rays);
+    checkStackless(tree, meshes, {}, rays);
+    scene->refitAccel();
+    checkScene(*scene, rays);
+  }
+
+  // wide BVHs are rebuilt by refitAccel
+  scene->buildAccel(AccelType::QBVH);
+  jitter(meshes, 0.01f, rng);
+  scene->refitAccel();
+  checkScene(*scene, rays);
+}
+
+/**
+ * built acceleration structures added to a scene as geometries are placed
+ * as they are, next to the meshes and instances of the scene
+ */
+void checkPrebuilt(int id) {
+  std::mt19937 rng(id);
+  auto cornell = genCornellBoxScene(id);
+  const std::vector<std::shared_ptr<Geometry>> &geoms = cornell->getGeometries();
+  std::vector<std::shared_ptr<Mesh>> meshes = meshesOf(*cornell);
+  auto object = makeInstanceObject({geoms.begin(), geoms.begin() + 2});
+  Scene scene(cornell->getLights());
+  scene.addGeometry(object);
+  scene.addGeometry(std::make_shared<QBVHAccel>(
+      MeshPrimitives({meshes.begin() + 2, meshes.begin() + 4})));
+  scene.addGeometry(std::vector<std::shared_ptr<Geometry>>(geoms.begin() + 4, geoms.end()));
+  scene.addGeometry(makeInstance(object, 0.5f, vec3(0.3f, 0, 0.3f)));
+  std::vector<Ray> rays = makeSceneRays(id, rng);
+  for (AccelType type : {AccelType::KD_TREE, AccelType::QBVH}) {
+    scene.buildAccel(type);
+    checkScene(scene, rays);
+  }
+  // the QBVH object cannot be refit, the scene is rebuilt around it
+  scene.refitAccel();
+  checkScene(scene, rays);
+}
+
+}  // namespace
+
+int main() {
+  checkRefit(0, false);
+  checkRefit(1, true);
+  checkPrebuilt(0);
+  return testFailures() ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+#include <accel_check.h>
+#include <cornell_box.h>
+#include <instance.h>
+#include <snapshot.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+/* The materials of every mesh of a scene and of its lights, the table of its snapshots */
+std::vector<std::shared_ptr<BRDF>> materialsOf(const Scene &scene) {
+  std::vector<std::shared_ptr<Geometry>> geoms = scene.getGeometries();
+  for (auto &light : scene.getLights())
+    for (auto &geom : light->getGeometries()) geoms.push_back(geom);
+  std::vector<std::shared_ptr<BRDF>> materials;
+  for (auto &geom : geoms) {
+    auto mesh = std::dynamic_pointer_cast<Mesh>(geom);
+    if (mesh && mesh->getMaterial() &&
+        std::find(materials.begin(), materials.end(), mesh->getMaterial()) == materials.end())
+      materials.push_back(mesh->getMaterial());
+  }
+  return materials;
+}
+
+std::vector<char> readFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+void writeFile(const std::string &path, const std::vector<char> &data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+/**
+ * save the accelerator of a scene, then load copies of the snapshot with a
+ * far out of range int written at every 4-byte offset. A copy must either be
+ * rejected or load into a structure the rays can traverse.
+ */
+void checkCorruptSnapshots(const Scene &scene, const std::string &path, const std::vector<Ray> &rays) {
+  std::vector<std::shared_ptr<BRDF>> materials = materialsOf(scene);
+  CHECK(scene.saveSnapshot(path, 1, materials));
+  Scene intact(scene.getLights());
+  CHECK(intact.loadSnapshot(path, 1, materials));
+  for (const Ray &ray : rays) {
+    Interaction found, expected;
+    bool hit = intact.intersect(ray, found);
+    CHECK(hit == scene.intersect(ray, expected));
+    if (hit) CHECK(found.entryDist == expected.entryDist && found.type == expected.type);
+  }
+
+  std::vector<char> data = readFile(path);
+  for (size_t offset = 0; offset + sizeof(int) <= data.size(); offset += sizeof(int)) {
+    for (int value : {50000000, -2}) {
+      std::vector<char> corrupt = data;
+      std::memcpy(corrupt.data() + offset, &value, sizeof(int));
+      writeFile(path, corrupt);
+      Scene loaded(scene.getLights());
+      if (!loaded.loadSnapshot(path, 1, materials)) continue;
+      Interaction interaction;
+      for (const Ray &ray : rays) {
+        loaded.intersect(ray, interaction);
+        (void)loaded.occluded(ray, 1);
+      }
+    }
+  }
+
+  // the light ids of the snapshot must name lights of the loading scene
+  writeFile(path, data);
+  Scene unlit;
+  CHECK(!unlit.loadSnapshot(path, 1, materials));
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(11);
+  std::string path = (std::filesystem::temp_directory_path() / "snapshot_test.bin").string();
+  std::vector<Ray> rays = makeRandomRays(16, rng);
+  auto camera = genCamera(0, vec2i(4, 4));
+  for (int dx = 0; dx < 4; dx++)
+    for (int dy = 0; dy < 4; dy++) rays.push_back(camera->generateRay(dx, dy));
+
+  auto cornell = genCornellBoxScene(0);
+  Scene scene(cornell->getLights());
+  scene.addGeometry(cornell->getGeometries());
+  scene.buildAccel();
+  checkCorruptSnapshots(scene, path, rays);
+
+  // instances of a shared object store the top level tree and the object
+  std::vector<std::shared_ptr<Geometry>> box(cornell->getGeometries().end() - 2,
+                                             cornell->getGeometries().end());
+  auto object = makeInstanceObject(box);
+  Scene instanced(cornell->getLights());
+  instanced.addGeometry(cornell->getGeometries());
+  instanced.addGeometry(makeInstance(object, 0.5f, vec3(0.3f, 0, 0.3f)));
+  instanced.addGeometry(makeInstance(object, 0.5f, vec3(-0.3f, 0, 0.3f)));
+  instanced.buildAccel();
+  checkCorruptSnapshots(instanced, path, rays);
+
+  std::filesystem::remove(path);
+  return testFailures() ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+#ifndef CS171_TESTS_TEST_H_
+#define CS171_TESTS_TEST_H_
+#include <cstdio>
+
+/* Number of the checks that failed so far, the exit code of a test */
+inline int &testFailures() {
+  static int failures = 0;
+  return failures;
+}
+
+/* Report a failed condition and keep running the test */
+#define CHECK(cond)                                                       \
+  do {                                                                    \
+    if (!(cond)) {                                                        \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                   #cond);                                                \
+      testFailures()++;                                                   \
+    }                                                                     \
+  } while (0)
+
+#endif  // CS171_TESTS_TEST_H_
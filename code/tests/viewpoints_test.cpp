@@ -0,0 +1,64 @@
+#include <viewpoints.h>
+#include <test.h>
+#include <algorithm>
+#include <random>
+
+namespace {
+
+/* n view points spread over the box [-scale, scale]^3 */
+std::vector<ViewPoint> makeViewPoints(int n, Float scale, std::mt19937 &rng) {
+  std::uniform_real_distribution<Float> coord(-scale, scale);
+  std::vector<ViewPoint> points;
+  for (int i = 0; i < n; i++)
+    points.emplace_back(vec3(coord(rng), coord(rng), coord(rng)), vec3(0, 1, 0), vec3::Ones(), 1, i, 0);
+  return points;
+}
+
+/**
+ * compare the points a ViewPointGrid finds with the ones of a KdPointTree
+ * for random searches of radius up to the one of the grid
+ */
+void checkGrid(const std::vector<ViewPoint> &points, Float radius, Float scale, std::mt19937 &rng) {
+  ViewPointGrid grid(points, radius);
+  KdPointTree tree(points);
+  std::uniform_real_distribution<Float> coord(-scale, scale), fraction(0, 1);
+  std::vector<int> found;
+  std::vector<const ViewPoint *> nearby;
+  for (int q = 0; q < 200; q++) {
+    // half of the searches start at a point, so that they find something
+    vec3 pos = q % 2 ? points[q % points.size()].C : vec3(coord(rng), coord(rng), coord(rng));
+    Float r = radius * fraction(rng);
+    found.clear();
+    nearby.clear();
+    grid.search(found, pos, r);
+    tree.search(nearby, pos, r);
+    std::vector<int> expected;
+    for (auto p : nearby) expected.push_back(static_cast<int>(p - points.data()));
+    std::sort(found.begin(), found.end());
+    std::sort(expected.begin(), expected.end());
+    CHECK(found == expected);
+  }
+}
+
+}  // namespace
+
+int main() {
+  std::mt19937 rng(5);
+  std::vector<ViewPoint> points = makeViewPoints(2000, 1, rng);
+  checkGrid(points, 0.05f, 1, rng);
+  checkGrid(points, 0.3f, 1, rng);
+  // radii far below the spacing of the points, the cells are clamped
+  checkGrid(points, 1e-12f, 1, rng);
+  std::vector<ViewPoint> far = makeViewPoints(500, 1e6f, rng);
+  checkGrid(far, 1e5f, 1e6f, rng);
+
+  // a grid of radius 0 finds nothing and does not divide by it
+  ViewPointGrid empty(points, 0);
+  std::vector<int> found;
+  empty.search(found, points[0].C, 0);
+  CHECK(found.empty());
+  ViewPointGrid none(std::vector<ViewPoint>{}, 0.1f);
+  none.search(found, vec3::Zero(), 0.1f);
+  CHECK(found.empty());
+  return testFailures() ? 1 : 0;
+}